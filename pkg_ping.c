@@ -45,149 +45,4819 @@
 /*
 	indent pkg_ping.c -bap -br -ce -ci4 -cli0 -d0 -di0 -i8 \
 	-ip -l79 -nbc -ncdb -ndj -ei -nfc1 -nlp -npcs -psl -sc -sob
-	cc pkg_ping.c -pipe -o pkg_ping
+	cc pkg_ping.c -pipe -o pkg_ping -ltls -lm
+	cc pkg_ping.c -pipe -o pkg_ping -ltls -lasr -lbsd -lmd -lm	(Linux)
  */
 
+/* asprintf(), and the pidfd and timerfd of the event backend */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/event.h>
-#include <sys/sysctl.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+/* in base on OpenBSD; elsewhere from libasr, libmd and LibreTLS */
+#include <asr.h>
+#include <sha2.h>
+#include <tls.h>
+
+#ifdef __OpenBSD__
+#include <sys/sysctl.h>
+#endif
+
+#ifdef __linux__
+/* strlcpy(), strtonum() and arc4random_uniform() come from libbsd */
+#include <bsd/stdlib.h>
+#include <bsd/string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#else
+#include <sys/event.h>
+#endif
+
+/* pledge(2) and unveil(2) are OpenBSD's. Elsewhere the host sandboxes it */
+#ifndef __OpenBSD__
+#define pledge(promises, execpromises)	0
+#define unveil(path, permissions)	0
+#endif
+
+/* what pkg_ping remembers of each mirror between runs */
+#define HIST_PATH	"/var/db/pkg_ping"
+#define HIST_TMP	"/var/db/pkg_ping.tmp"
+
+/* weight of the newest result in the moving average */
+#define HIST_ALPHA	0.3
+
+/* -k only trusts mirrors seen this recently */
+#define HIST_FRESH	(7 * 24 * 60 * 60)
+
+/* records of mirrors not seen for this long are dropped */
+#define HIST_EXPIRE	(90 * 24 * 60 * 60)
+
+/* -k sweeps everything if the best is this much slower than its history */
+#define HIST_SLACK	2.0
+
+/* where the mirrors are published, unless --list-url says otherwise */
+#define LIST_URL	"https://www.openbsd.org/ftp.html"
+
+/* the last ftp.html parsed, to revalidate or to fall back on */
+#define LIST_PATH	"/var/db/pkg_ping.list"
+#define LIST_TMP	"/var/db/pkg_ping.list.tmp"
+
+/* how long ftp.html may stall when there is a LIST_PATH to fall back on */
+#define LIST_STALL	5
+
+/* the time zone, which tells the country pkg_ping runs in without -z */
+#define LOCALTIME	"/etc/localtime"
+#define ZONE_TAB	"/usr/share/zoneinfo/zone.tab"
+
+/* how near a mirror is likely to be. The nearest are probed first */
+#define NEAR_KNOWN	0
+#define NEAR_HOME	1
+#define NEAR_REGION	2
+#define NEAR_FAR	3
+
+/* what ev_add() watches for. EVENT_ACCEPT stays until ev_del() */
+#define EVENT_READ	1
+#define EVENT_WRITE	2
+#define EVENT_EXIT	3
+#define EVENT_ACCEPT	4
+
+/* the most events one ev_wait() hands back */
+#define EVENT_BATCH	256
+
+/* getopt_long() values of the options which have no short one */
+#define OPT_TRACE	256
+#define OPT_LIST_URL	257
+
+/* -d: installurl is replaced through this, so it is never half written */
+#define INSTALLURL_TMP	"/etc/installurl.tmp"
+
+/*
+ * -d: each re-probe takes the DAEMON_TOP mirrors which have been fastest
+ * lately, the one installed and DAEMON_TAIL more of the rest in turn. A
+ * mirror has to have beaten the installed one by the -H margin this many
+ * times in a row before it replaces it.
+ */
+#define DAEMON_TOP	3
+#define DAEMON_TAIL	2
+#define DAEMON_STREAK	3
+
+/*
+ * -L: each request is relayed to the least loaded of the PROXY_TOP
+ * fastest mirrors, for up to PROXY_MAX clients at a time
+ */
+#define PROXY_TOP	3
+#define PROXY_MAX	64
+
+/* a relay stops reading from its mirror while this much awaits the client */
+#define PROXY_BUF	(256 * 1024)
+
+/* how long a client may stall, a mirror only has the -s timeout */
+#define PROXY_IDLE	60
+
+/*
+ * -g: the file is fetched from the FETCH_TOP fastest mirrors at once,
+ * FETCH_SEG bytes per request. Once nothing is left to hand out, a
+ * mirror which is done takes over half of what a slower one has left,
+ * if that is at least FETCH_STEAL.
+ */
+#define FETCH_TOP	4
+#define FETCH_SEG	(4 * 1024 * 1024)
+#define FETCH_STEAL	(256 * 1024)
+
+/* -t: how many release/arch targets one run ranks the mirrors for */
+#define TARGET_MAX	16
+
+/*
+ * -r serves the ranking to up to RANK_MAX hosts at once, each of which
+ * may take RANK_IDLE seconds over it. -R takes a ranking which is up to
+ * RANK_STALE seconds old, of URLs up to RANK_URL bytes long, within what
+ * the writer takes for /etc/installurl.
+ */
+#define RANK_MAX	32
+#define RANK_IDLE	5
+#define RANK_STALE	(3 * 60 * 60)
+#define RANK_URL	255
+
+/* the mirror table is carved out of blocks of at least this size */
+#define ARENA_BLOCK	(64 * 1024)
+
+/* an event: the fd or process, EVENT_READ, _WRITE or _EXIT and whose */
+struct event_st {
+	uintptr_t ident;
+	int filter;
+	void *udata;
+};
+
+struct hist_st {
+	char *ftp_file;
+	double ewma;
+	int ok;
+	int fails;
+	time_t seen;
+};
+
 struct mirror_st {
 	double diff;
 	char *ftp_file;
 	char *label;
+
+	/* where the time went, for the in-process probes */
+	double dns;
+	double connect;
+	double handshake;
+	double ttfb;
+	double xfer;
+
+	/* with -b, bytes per second over the transfer phase */
+	double rate;
+
+	struct hist_st *hist;
+
+	/* with -n, what each probe of it came to */
+	double *sample;
+	int sample_len;
+
+	/* the last round of -n or -T it was probed in */
+	int round;
+
+	/* how the last probe of it ended, and when if it was cut off */
+	int8_t result;
+	double cut;
+
+	/* with -n or -T, its connection kept alive between rounds */
+	int idle_fd;
+	struct tls *idle_tls;
+
+	/*
+	 * what setting up its last new connection cost, and the -m time of
+	 * the probes which went over a kept-alive one instead
+	 */
+	double cold;
+	double warm;
+	int warm_len;
+
+	/* -L: requests being relayed from it, and its time to first byte */
+	int active;
+	double live;
+
+	/* -e: the lookup of its host, which it waits on to be probed */
+	struct dns_st *lookup;
+
+	/* a NEAR_ value, from its label and history */
+	int8_t near;
+};
+
+#define RESULT_OK	0
+#define RESULT_TIMEOUT	1
+#define RESULT_CUTOFF	2
+#define RESULT_ERROR	3
+
+/* the most samples -n takes of a mirror */
+#define SAMPLE_MAX	100
+
+/* the z-score of the 95% confidence interval */
+#define SAMPLE_Z	1.96
+
+/*
+ * -j auto: the most probes it lets run at once, and how many times that
+ * many probes make up the window it is judged on. A level is only kept if
+ * the bytes per second rose by AIMD_GAIN of what it added in proportion,
+ * and the probes took less than AIMD_INFLATE times as long, against their
+ * history, as at the least inflated level.
+ */
+#define AIMD_MAX	32
+#define AIMD_WINDOW	2
+#define AIMD_GAIN	0.5
+#define AIMD_INFLATE	1.5
+
+/* the first round of -T only asks for the start of the file */
+#define TOURNEY_RANGE	"Range: bytes=0-1023\r\n"
+
+/* what -m ranks the mirrors on */
+#define METRIC_TOTAL	0
+#define METRIC_TTFB	1
+#define METRIC_CONNECT	2
+#define METRIC_RATE	3
+
+/* how much of the -b file is fetched, unless -B says otherwise */
+#define RATE_CAP	(4 * 1024 * 1024)
+
+/* http_st.state */
+#define HTTP_CONNECT	0
+#define HTTP_HANDSHAKE	1
+#define HTTP_SEND	2
+#define HTTP_HEADER	3
+#define HTTP_BODY	4
+#define HTTP_DONE	5
+#define HTTP_FAIL	6
+
+/* http_st.chunk_state */
+#define CHUNK_SIZE	0
+#define CHUNK_DATA	1
+#define CHUNK_CRLF	2
+#define CHUNK_TRAILER	3
+
+/* what http_step() waits on, kept apart from read()/write() results */
+#define HTTP_WANT_READ	(-2)
+#define HTTP_WANT_WRITE	(-3)
+
+#define HTTP_HEAD_MAX	8192
+
+/*
+ * what an event's udata points to, where one queue carries both: it is
+ * the first member of each, so it can be read before the type is known
+ */
+#define UDATA_DNS	1
+#define UDATA_PROBE	2
+
+/* a host looked up ahead of the probes, see dns_prefetch() */
+struct dns_st {
+	int8_t kind;
+	char *host;
+	char *port;
+	struct addrinfo *res0;
+	struct asr_query *q;
+	struct timespec start;
+	struct timespec deadline;
+	double time;
+	int error;
+};
+
+struct http_st {
+	int fd;
+	int8_t state;
+	int8_t https;
+	int8_t chunked;
+	int8_t chunk_state;
+	int8_t chunk_line;
+	int8_t redirects;
+	int status;
+	char *url;
+	char *host;
+	char *port;
+	char *path;
+	struct addrinfo *res0, *res;
+	int8_t res_shared;
+	struct tls *tls;
+	struct tls_config *tls_cfg;
+	long long length;
+	long long got;
+	long long chunk;
+	size_t head_len, head_off;
+	char head[HTTP_HEAD_MAX];
+
+	/*
+	 * seconds spent in each phase, summed over redirects. 'mark' is
+	 * when the phase in progress began. The ttfb phase runs from the
+	 * connection being ready to the first byte of the response.
+	 */
+	struct timespec mark;
+	double dns;
+	double connect;
+	double handshake;
+	double ttfb;
+
+	/* if set, receives the body as it arrives */
+	void (*sink)(void *, const char *, size_t);
+	void *sink_arg;
+
+	/* if set, the body is only read up to this many bytes */
+	long long cap;
+
+	/* where a 206's body starts, and the size of the whole, or -1 */
+	long long range_off;
+	long long range_total;
+
+	/* hosts looked up already, and how long the one used took */
+	struct dns_st *dns_cache;
+	int dns_cache_len;
+	double dns_cached;
+
+	/* more request header lines, eg. If-None-Match, and the reply's */
+	const char *extra;
+	char *etag;
+	char *modified;
+
+	/*
+	 * asks for keep-alive; whether the connection is fit for another
+	 * request, and whether this one went over a kept-alive connection
+	 */
+	int8_t keep;
+	int8_t reusable;
+	int8_t reused;
+};
+
+/*
+ * -j auto: how many probes may be in flight, raised by one after each
+ * window of probes at that level and halved once they interfere
+ */
+struct aimd_st {
+	int level;
+	int ceiling;
+
+	/* the highest level below the ceiling which didn't interfere */
+	int good;
+
+	/* the window after a cut still ends the probes from before it */
+	int8_t drain;
+
+	/* the probes which ended since the last window */
+	int done;
+	long long bytes;
+	double inflate;
+	int inflate_len;
+	struct timespec start;
+
+	/* the last window's bytes per second and level */
+	double rate;
+	int rate_level;
+
+	/* the least mean inflation of a window so far */
+	double base;
+};
+
+/* the mirrors of ftp.html, parsed as the page arrives */
+struct list_st {
+	char *line;
+	size_t len, max;
+	char *label;
+	int8_t stop;
+	int8_t error;
+	struct mirror_st *entry;
+	int length, entry_max;
+};
+
+/*
+ * memory which lives until exit, handed out from big blocks. Each block
+ * starts with a pointer to the one before it.
+ */
+struct arena_st {
+	char *block;
+	size_t used, size;
+};
+
+/*
+ * an open-addressed hash set of strings kept in an arena_st, with room
+ * for a pointer of the caller's beside each, found by intern_val()
+ */
+struct intern_st {
+	char **slot;
+	void **val;
+	size_t len, max;
+};
+
+/* the country and region pkg_ping runs in, either may be NULL */
+struct home_st {
+	const char *country;
+	const char *region;
+};
+
+/* the countries of ftp.html, with their ISO 3166 code for ZONE_TAB */
+static const struct country_st {
+	const char *name;
+	const char *code;
+	const char *region;
+} country[] = {
+	{ "Argentina", "AR", "South America" },
+	{ "Australia", "AU", "Oceania" },
+	{ "Austria", "AT", "Europe" },
+	{ "Bangladesh", "BD", "Asia" },
+	{ "Belgium", "BE", "Europe" },
+	{ "Brazil", "BR", "South America" },
+	{ "Bulgaria", "BG", "Europe" },
+	{ "Canada", "CA", "North America" },
+	{ "Chile", "CL", "South America" },
+	{ "China", "CN", "Asia" },
+	{ "Colombia", "CO", "South America" },
+	{ "Costa Rica", "CR", "North America" },
+	{ "Croatia", "HR", "Europe" },
+	{ "Czech Republic", "CZ", "Europe" },
+	{ "Czechia", "CZ", "Europe" },
+	{ "Denmark", "DK", "Europe" },
+	{ "Ecuador", "EC", "South America" },
+	{ "Estonia", "EE", "Europe" },
+	{ "Finland", "FI", "Europe" },
+	{ "France", "FR", "Europe" },
+	{ "Germany", "DE", "Europe" },
+	{ "Greece", "GR", "Europe" },
+	{ "Hong Kong", "HK", "Asia" },
+	{ "Hungary", "HU", "Europe" },
+	{ "Iceland", "IS", "Europe" },
+	{ "India", "IN", "Asia" },
+	{ "Indonesia", "ID", "Asia" },
+	{ "Iran", "IR", "Asia" },
+	{ "Ireland", "IE", "Europe" },
+	{ "Israel", "IL", "Asia" },
+	{ "Italy", "IT", "Europe" },
+	{ "Japan", "JP", "Asia" },
+	{ "Kazakhstan", "KZ", "Asia" },
+	{ "Kenya", "KE", "Africa" },
+	{ "Korea", "KR", "Asia" },
+	{ "Latvia", "LV", "Europe" },
+	{ "Lithuania", "LT", "Europe" },
+	{ "Luxembourg", "LU", "Europe" },
+	{ "Malaysia", "MY", "Asia" },
+	{ "Mexico", "MX", "North America" },
+	{ "Moldova", "MD", "Europe" },
+	{ "Netherlands", "NL", "Europe" },
+	{ "New Caledonia", "NC", "Oceania" },
+	{ "New Zealand", "NZ", "Oceania" },
+	{ "Norway", "NO", "Europe" },
+	{ "Philippines", "PH", "Asia" },
+	{ "Poland", "PL", "Europe" },
+	{ "Portugal", "PT", "Europe" },
+	{ "Romania", "RO", "Europe" },
+	{ "Russia", "RU", "Europe" },
+	{ "Serbia", "RS", "Europe" },
+	{ "Singapore", "SG", "Asia" },
+	{ "Slovakia", "SK", "Europe" },
+	{ "Slovenia", "SI", "Europe" },
+	{ "South Africa", "ZA", "Africa" },
+	{ "South Korea", "KR", "Asia" },
+	{ "Spain", "ES", "Europe" },
+	{ "Sweden", "SE", "Europe" },
+	{ "Switzerland", "CH", "Europe" },
+	{ "Taiwan", "TW", "Asia" },
+	{ "Thailand", "TH", "Asia" },
+	{ "Turkey", "TR", "Europe" },
+	{ "UK", "GB", "Europe" },
+	{ "Ukraine", "UA", "Europe" },
+	{ "United Kingdom", "GB", "Europe" },
+	{ "USA", "US", "North America" },
+	{ "Vietnam", "VN", "Asia" },
+};
+#define COUNTRIES	(sizeof(country) / sizeof(country[0]))
+
+/* -e: the mirror table, grown while ftp.html is still arriving */
+struct pipe_st {
+	struct arena_st *arena;
+	struct intern_st urls, labels;
+
+	/* "host port" of each lookup, beside its dns_st */
+	struct intern_st hosts;
+	struct mirror_st **array;
+	int length, max;
+
+	/* how many of the list's entries it has been through */
+	int taken;
+
+	/* each host's lookup, in the order they were started */
+	struct dns_st **dns;
+	int dns_len, dns_max;
+
+	struct hist_st *hist;
+	int hist_length;
+	struct home_st *home;
+	int samples;
+	int url_max;
+	int8_t u, insecure;
+};
+
+/* one probe in flight: an ftp child or an in-process request */
+struct probe_st {
+	int8_t kind;
+	pid_t pid;
+	int index;
+	int8_t busy;
+	int8_t killed;
+	struct timespec start;
+	struct http_st http;
+};
+
+/* -L: a client of the proxy and the mirror request relayed to it */
+struct proxy_st {
+	int fd;
+	int8_t busy;
+	int8_t head_sent;
+	int8_t chunked;
+	int8_t paused;
+	int8_t closing;
+
+	/* a bit for each mirror tried, and the last status one answered */
+	int tried;
+	int status;
+
+	/*
+	 * the body bytes the client has been sent, of the Content-Length
+	 * it was promised or -1, and where the mirror relaying it now was
+	 * asked to carry on from
+	 */
+	long long sent, total, resume;
+	char range[64];
+
+	struct mirror_st *m;
+	char *path;
+	char req[HTTP_HEAD_MAX];
+	size_t req_len;
+
+	/* what waits to be written to the client */
+	char *out;
+	size_t out_len, out_off, out_max;
+
+	struct timespec dialed, progress;
+	struct http_st up;
+};
+
+/* -g: a mirror's share of the file and the range it is fetching */
+struct fetch_st {
+	struct mirror_st *m;
+	int8_t busy;
+	int8_t dead;
+	int fd;
+	long long off, end;
+	long long written;
+	long long bytes;
+	char range[64];
+	struct timespec progress;
+	struct http_st http;
+};
+
+/* -g: a range to fetch again, after the mirror fetching it failed */
+struct seg_st {
+	long long off, end;
+};
+
+/* --trace: the run as a timeline in Chrome's trace event format */
+struct trace_st {
+	FILE *fp;
+	struct timespec t0;
+	int n;
 };
 
+/* seconds from 'start' to 'end' */
+static double
+ts_elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) +
+	    (double)(end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/*
+ * --trace: adds a complete ("X") event from 'start' to 'end' on thread
+ * 'tid', the probe slot, or 0 for everything else. 'args' is NULL or the
+ * members of its JSON "args" object.
+ */
+static void
+trace_span(struct trace_st *t, const char *name, int tid,
+    const struct timespec *start, const struct timespec *end,
+    const char *args)
+{
+	const char *p;
+
+	if (t->fp == NULL)
+		return;
+
+	fprintf(t->fp, "%s{\"name\":\"", (t->n++ > 0) ? ",\n" : "");
+	for (p = name; *p != '\0'; ++p) {
+		if (*p == '"' || *p == '\\')
+			fprintf(t->fp, "\\%c", *p);
+		else if ((unsigned char)*p < 0x20)
+			fprintf(t->fp, "\\u%04x", *p);
+		else
+			putc(*p, t->fp);
+	}
+	fprintf(t->fp, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+	    "\"ts\":%.3f,\"dur\":%.3f", tid,
+	    ts_elapsed(&t->t0, start) * 1000000,
+	    ts_elapsed(start, end) * 1000000);
+	if (args != NULL)
+		fprintf(t->fp, ",\"args\":{%s}", args);
+	fprintf(t->fp, "}");
+}
+
+/* a probe's span, named after the mirror, with where its time went */
+static void
+trace_probe(struct trace_st *t, struct probe_st *p, int tid,
+    const char *ftp_file, int round, const char *result,
+    const struct timespec *end, int8_t use_ftp)
+{
+	struct http_st *h = &p->http;
+	char args[256];
+
+	if (t->fp == NULL)
+		return;
+	if (use_ftp) {
+		snprintf(args, sizeof(args),
+		    "\"round\":%d,\"result\":\"%s\"", round, result);
+	} else {
+		snprintf(args, sizeof(args),
+		    "\"round\":%d,\"result\":\"%s\",\"dns\":%f,"
+		    "\"connect\":%f,\"tls\":%f,\"ttfb\":%f,\"bytes\":%lld,"
+		    "\"reused\":%d", round, result, h->dns + h->dns_cached,
+		    h->connect, h->handshake, h->ttfb, h->got, h->reused);
+	}
+	trace_span(t, ftp_file, tid, &p->start, end, args);
+}
+
+/*
+ * the closing ']' is optional in the trace event format, so a run which
+ * exits on an error still leaves a usable trace
+ */
+static void
+trace_close(struct trace_st *t)
+{
+	if (t->fp == NULL)
+		return;
+	fprintf(t->fp, "\n]\n");
+	fclose(t->fp);
+	t->fp = NULL;
+}
+
+static int
+diff_cmp(const void *a, const void *b)
+{
+	struct mirror_st **one = (struct mirror_st **) a;
+	struct mirror_st **two = (struct mirror_st **) b;
+
+	/* lasting more rounds ranks higher. Failures are left in round 0 */
+	if ((*one)->round != (*two)->round)
+		return (*two)->round - (*one)->round;
+
+	if ((*one)->diff < (*two)->diff)
+		return -1;
+	if ((*one)->diff > (*two)->diff)
+		return 1;
+	return 0;
+}
+
+static int
+label_cmp(const void *a, const void *b)
+{
+	struct mirror_st **one = (struct mirror_st **) a;
+	struct mirror_st **two = (struct mirror_st **) b;
+
+	/* list the USA mirrors first, it will subsort correctly */
+	int8_t temp = !strncmp("USA", (*one)->label, 3);
+	if (temp != !strncmp("USA", (*two)->label, 3)) {
+		if (temp)
+			return -1;
+		return 1;
+	}
+	return strcmp((*one)->label, (*two)->label);
+}
+
+static int
+label_rev_cmp(const void *a, const void *b)
+{
+	struct mirror_st **one = (struct mirror_st **) a;
+	struct mirror_st **two = (struct mirror_st **) b;
+
+	/* list the USA mirrors first, and will reverse subsort */
+	int8_t temp = !strncmp("USA", (*one)->label, 3);
+	if (temp != !strncmp("USA", (*two)->label, 3)) {
+		if (temp)
+			return -1;
+		return 1;
+	}
+	return strcmp((*two)->label, (*one)->label);
+}
+
+/* the nearest first, then the fastest lately, then as label_cmp() */
+static int
+near_cmp(const void *a, const void *b)
+{
+	struct mirror_st **one = (struct mirror_st **) a;
+	struct mirror_st **two = (struct mirror_st **) b;
+
+	if ((*one)->near != (*two)->near)
+		return (*one)->near - (*two)->near;
+	if ((*one)->near == NEAR_KNOWN) {
+		if ((*one)->hist->ewma < (*two)->hist->ewma)
+			return -1;
+		if ((*one)->hist->ewma > (*two)->hist->ewma)
+			return 1;
+	}
+	return label_cmp(a, b);
+}
+
+/*
+ * the country[] which a label starts with, eg. "USA (Boston, MA)", or
+ * -1 if it isn't one of them
+ */
+static int
+country_find(const char *label)
+{
+	size_t c, n;
+
+	for (c = 0; c < COUNTRIES; ++c) {
+		n = strlen(country[c].name);
+		if (strncasecmp(label, country[c].name, n))
+			continue;
+		if (label[n] == '\0' || label[n] == ' ' || label[n] == ',' ||
+		    label[n] == '(')
+			return c;
+	}
+	return -1;
+}
+
+/*
+ * how near m is likely to be: one which has been fast lately is known
+ * to be, then come the CDNs and the mirrors of the home country, and
+ * then those of its region
+ */
+static int8_t
+near_tier(struct mirror_st *m, struct home_st *home, time_t now)
+{
+	struct hist_st *h = m->hist;
+	int c;
+
+	if (h != NULL && h->ok > 0 && h->fails == 0 &&
+	    now - h->seen <= HIST_FRESH)
+		return NEAR_KNOWN;
+
+	/* a CDN answers from near wherever it is asked from */
+	if (strstr(m->label, "CDN") != NULL)
+		return NEAR_HOME;
+
+	c = country_find(m->label);
+	if (c == -1)
+		return NEAR_FAR;
+	if (home->country != NULL && !strcmp(home->country, country[c].name))
+		return NEAR_HOME;
+	if (home->region != NULL && !strcmp(home->region, country[c].region))
+		return NEAR_REGION;
+	return NEAR_FAR;
+}
+
+/*
+ * finds the country and region pkg_ping runs in: z is either, as given
+ * with -z, or else they come from the time zone, TZ or the LOCALTIME
+ * link, through its country code in ZONE_TAB. Returns -1 if z is
+ * neither, and leaves them NULL if the time zone doesn't tell.
+ */
+static int
+home_find(const char *z, struct home_st *home)
+{
+	static const char *part[][2] = {
+		{ "Africa/", "Africa" }, { "Asia/", "Asia" },
+		{ "Australia/", "Oceania" }, { "Europe/", "Europe" }
+	};
+	char path[PATH_MAX], *line = NULL, *p;
+	const char *zone;
+	size_t c, n, line_max = 0;
+	ssize_t len;
+	FILE *fp;
+
+	home->country = home->region = NULL;
+
+	if (z != NULL) {
+		for (c = 0; c < COUNTRIES; ++c) {
+			if (!strcasecmp(z, country[c].name)) {
+				home->country = country[c].name;
+				home->region = country[c].region;
+				return 0;
+			}
+			if (!strcasecmp(z, country[c].region))
+				home->region = country[c].region;
+		}
+		return (home->region != NULL) ? 0 : -1;
+	}
+
+	zone = getenv("TZ");
+	if (zone != NULL && *zone == ':')
+		++zone;
+	if (zone == NULL || *zone == '\0') {
+		len = readlink(LOCALTIME, path, sizeof(path) - 1);
+		if (len == -1)
+			return 0;
+		path[len] = '\0';
+		zone = strstr(path, "zoneinfo/");
+		if (zone == NULL)
+			return 0;
+		zone += 9;
+	}
+
+	/* "CC	coordinates	Zone/Name	comments" */
+	fp = fopen(ZONE_TAB, "r");
+	while (fp != NULL && getline(&line, &line_max, fp) != -1) {
+		if (line[0] == '#' || (p = strchr(line, '\t')) == NULL ||
+		    (p = strchr(p + 1, '\t')) == NULL)
+			continue;
+		n = strcspn(++p, "\t\n");
+		if (n != strlen(zone) || strncmp(p, zone, n))
+			continue;
+		for (c = 0; c < COUNTRIES; ++c) {
+			if (!strncmp(line, country[c].code, 2)) {
+				home->country = country[c].name;
+				home->region = country[c].region;
+				break;
+			}
+		}
+		break;
+	}
+	free(line);
+	if (fp != NULL)
+		fclose(fp);
+
+	/* a zone of a continent at least tells the region */
+	for (c = 0; home->region == NULL &&
+	    c < sizeof(part) / sizeof(part[0]); ++c) {
+		if (!strncmp(zone, part[c][0], strlen(part[c][0])))
+			home->region = part[c][1];
+	}
+	return 0;
+}
+
+/* the mirrors which didn't connect have a connect time of -1 */
+static int
+connect_cmp(const void *a, const void *b)
+{
+	struct mirror_st **one = (struct mirror_st **) a;
+	struct mirror_st **two = (struct mirror_st **) b;
+
+	if ((*one)->connect == -1 || (*two)->connect == -1)
+		return ((*one)->connect == -1) - ((*two)->connect == -1);
+	if ((*one)->connect < (*two)->connect)
+		return -1;
+	if ((*one)->connect > (*two)->connect)
+		return 1;
+	return 0;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double one = *(double *) a;
+	double two = *(double *) b;
+
+	if (one < two)
+		return -1;
+	if (one > two)
+		return 1;
+	return 0;
+}
+
+/*
+ * the q quantile of a mirror's samples and, from the binomial
+ * distribution of the order statistics, the samples bracketing its 95%
+ * confidence interval. With a handful of samples, that is the fastest
+ * and the slowest of them. Timeouts count as s and download errors as
+ * s + 1.
+ */
+static double
+sample_stat(struct mirror_st *m, double q, double *lo, double *hi)
+{
+	double spread, *x = m->sample;
+	int n = m->sample_len, a, b;
+
+	qsort(x, n, sizeof(double), double_cmp);
+
+	spread = SAMPLE_Z * sqrt(n * q * (1 - q));
+	a = (int) floor(n * q - spread);
+	b = (int) ceil(n * q + spread);
+	if (a < 1)
+		a = 1;
+	if (b > n)
+		b = n;
+	*lo = x[a - 1];
+	*hi = x[b - 1];
+
+	a = (int) ceil(n * q);
+	if (a < 1)
+		a = 1;
+	return x[a - 1];
+}
+
+static int
+dns_cmp(const void *a, const void *b)
+{
+	struct dns_st *one = (struct dns_st *) a;
+	struct dns_st *two = (struct dns_st *) b;
+	int n;
+
+	n = strcmp(one->host, two->host);
+	if (n != 0)
+		return n;
+	return strcmp(one->port, two->port);
+}
+
+static struct dns_st *
+dns_find(struct dns_st *d, int len, const char *host, const char *port)
+{
+	struct dns_st key;
+
+	if (d == NULL)
+		return NULL;
+	key.host = (char *) host;
+	key.port = (char *) port;
+	return bsearch(&key, d, len, sizeof(struct dns_st), dns_cmp);
+}
+
+/*
+ * The event backend, kqueue(2), or epoll(7) on Linux. There, a pidfd
+ * stands in for EVFILT_PROC and a timerfd times ev_wait(), as
+ * epoll_wait() would round the probes' timeouts to milliseconds. Each
+ * ev_add() watches an fd once, except for EVENT_ACCEPT, and its event
+ * carries 'udata' back.
+ */
+#ifdef __linux__
+
+/* epoll only hands back the fd, so the rest is looked up by it */
+struct ev_fd_st {
+	uintptr_t ident;
+	int filter;
+	void *udata;
+};
+static struct ev_fd_st *ev_fd;
+static int ev_fd_max;
+static int ev_timer = -1;
+
+static int
+ev_open(void)
+{
+	struct epoll_event e;
+	int q;
+
+	q = epoll_create1(EPOLL_CLOEXEC);
+	if (q == -1)
+		return -1;
+	ev_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	memset(&e, 0, sizeof(e));
+	e.events = EPOLLIN;
+	e.data.fd = ev_timer;
+	if (ev_timer == -1 || epoll_ctl(q, EPOLL_CTL_ADD, ev_timer, &e) == -1) {
+		close(q);
+		return -1;
+	}
+	return q;
+}
+
+static int
+ev_add(int q, uintptr_t ident, int filter, void *udata)
+{
+	struct epoll_event e;
+	struct ev_fd_st *p;
+	int fd = ident, max;
+
+	if (filter == EVENT_EXIT) {
+		fd = syscall(SYS_pidfd_open, (pid_t)ident, 0);
+		if (fd == -1)
+			return -1;
+	}
+	if (fd >= ev_fd_max) {
+		max = (fd + 1) * 2;
+		p = realloc(ev_fd, max * sizeof(struct ev_fd_st));
+		if (p == NULL)
+			return -1;
+		memset(p + ev_fd_max, 0,
+		    (max - ev_fd_max) * sizeof(struct ev_fd_st));
+		ev_fd = p;
+		ev_fd_max = max;
+	}
+	ev_fd[fd].ident = ident;
+	ev_fd[fd].filter = filter;
+	ev_fd[fd].udata = udata;
+
+	memset(&e, 0, sizeof(e));
+	e.events = (filter == EVENT_WRITE) ? EPOLLOUT : EPOLLIN;
+	if (filter != EVENT_ACCEPT)
+		e.events |= EPOLLONESHOT;
+	e.data.fd = fd;
+
+	/* an fd which has been watched before is still in the set */
+	if (epoll_ctl(q, EPOLL_CTL_MOD, fd, &e) == -1 &&
+	    (errno != ENOENT || epoll_ctl(q, EPOLL_CTL_ADD, fd, &e) == -1)) {
+		if (filter == EVENT_EXIT)
+			close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+ev_del(int q, int fd)
+{
+	return epoll_ctl(q, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int
+ev_wait(int q, struct event_st *ev, int n, const struct timespec *timeout)
+{
+	struct epoll_event e[EVENT_BATCH];
+	struct itimerspec it;
+	struct ev_fd_st *p;
+	uint64_t ticks;
+	int i, k, r, saved, wait = -1;
+
+	if (n > EVENT_BATCH)
+		n = EVENT_BATCH;
+	memset(&it, 0, sizeof(it));
+	if (timeout != NULL && timeout->tv_sec == 0 && timeout->tv_nsec == 0)
+		wait = 0;
+	else if (timeout != NULL) {
+		it.it_value = *timeout;
+		if (timerfd_settime(ev_timer, 0, &it, NULL) == -1)
+			return -1;
+	}
+
+	r = epoll_wait(q, e, n, wait);
+
+	/* disarmed and drained, so it doesn't wake the next one */
+	if (timeout != NULL && wait == -1) {
+		saved = errno;
+		memset(&it, 0, sizeof(it));
+		timerfd_settime(ev_timer, 0, &it, NULL);
+		read(ev_timer, &ticks, sizeof(ticks));
+		errno = saved;
+	}
+	if (r == -1)
+		return -1;
+
+	for (i = k = 0; i < r; ++i) {
+		if (e[i].data.fd == ev_timer)
+			continue;
+		p = &ev_fd[e[i].data.fd];
+		ev[k].ident = p->ident;
+		ev[k].filter = (p->filter == EVENT_ACCEPT) ? EVENT_READ :
+		    p->filter;
+		ev[k].udata = p->udata;
+		if (p->filter == EVENT_EXIT)
+			close(e[i].data.fd);
+		++k;
+	}
+	return k;
+}
+
+static void
+ev_close(int q)
+{
+	close(ev_timer);
+	ev_timer = -1;
+	close(q);
+}
+
+#else
+
+static int
+ev_open(void)
+{
+	return kqueue();
+}
+
+static int
+ev_add(int q, uintptr_t ident, int filter, void *udata)
+{
+	struct kevent ke;
+
+	switch (filter) {
+	case EVENT_READ:
+		EV_SET(&ke, ident, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0,
+		    udata);
+		break;
+	case EVENT_WRITE:
+		EV_SET(&ke, ident, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0,
+		    udata);
+		break;
+	case EVENT_EXIT:
+		EV_SET(&ke, ident, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT,
+		    0, udata);
+		break;
+	default:
+		EV_SET(&ke, ident, EVFILT_READ, EV_ADD, 0, 0, udata);
+		break;
+	}
+	return kevent(q, &ke, 1, NULL, 0, NULL);
+}
+
+static int
+ev_del(int q, int fd)
+{
+	struct kevent ke;
+
+	EV_SET(&ke, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	return kevent(q, &ke, 1, NULL, 0, NULL);
+}
+
+static int
+ev_wait(int q, struct event_st *ev, int n, const struct timespec *timeout)
+{
+	struct kevent kev[EVENT_BATCH];
+	int i, r;
+
+	if (n > EVENT_BATCH)
+		n = EVENT_BATCH;
+	r = kevent(q, NULL, 0, kev, n, timeout);
+	for (i = 0; i < r; ++i) {
+		ev[i].ident = kev[i].ident;
+		if (kev[i].filter == EVFILT_PROC)
+			ev[i].filter = EVENT_EXIT;
+		else if (kev[i].filter == EVFILT_WRITE)
+			ev[i].filter = EVENT_WRITE;
+		else
+			ev[i].filter = EVENT_READ;
+		ev[i].udata = kev[i].udata;
+	}
+	return r;
+}
+
+static void
+ev_close(int q)
+{
+	close(q);
+}
+
+#endif
+
+/*
+ * A small non-blocking HTTP/1.1 client, driven by ev_wait(). It does
+ * what the mirror probes need from ftp(1): GET one file, follow
+ * redirects, read the whole body and report whether it was a 200.
+ */
+
+static int
+http_split(struct http_st *h, const char *url)
+{
+	char *p, *q;
+
+	free(h->url);
+	h->url = strdup(url);
+	if (h->url == NULL)
+		return -1;
+
+	if (!strncmp(h->url, "https://", 8)) {
+		h->https = 1;
+		p = h->url + 8;
+	} else if (!strncmp(h->url, "http://", 7)) {
+		h->https = 0;
+		p = h->url + 7;
+	} else
+		return -1;
+
+	/* the path keeps its '/', so it is copied out of the host */
+	q = strchr(p, '/');
+	free(h->path);
+	h->path = strdup((q == NULL) ? "/" : q);
+	if (h->path == NULL)
+		return -1;
+	if (q != NULL)
+		*q = '\0';
+
+	h->port = (h->https) ? "443" : "80";
+	if (*p == '[') {
+		h->host = ++p;
+		q = strchr(p, ']');
+		if (q == NULL)
+			return -1;
+		*q++ = '\0';
+		if (*q == ':')
+			h->port = q + 1;
+	} else {
+		h->host = p;
+		q = strrchr(p, ':');
+		if (q != NULL) {
+			*q = '\0';
+			h->port = q + 1;
+		}
+	}
+	if (*h->host == '\0' || *h->port == '\0')
+		return -1;
+	return 0;
+}
+
+/* starts a non-blocking connect() to the first usable address */
+static int
+http_connect(struct http_st *h)
+{
+	for (; h->res != NULL; h->res = h->res->ai_next) {
+		h->fd = socket(h->res->ai_family,
+		    h->res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    h->res->ai_protocol);
+		if (h->fd == -1)
+			continue;
+		if (connect(h->fd, h->res->ai_addr, h->res->ai_addrlen) == 0 ||
+		    errno == EINPROGRESS)
+			return 0;
+		close(h->fd);
+		h->fd = -1;
+	}
+	return -1;
+}
+
+/* ends the phase in progress, adding its time to 'phase' */
+static void
+http_mark(struct http_st *h, double *phase)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	*phase += ts_elapsed(&h->mark, &now);
+	h->mark = now;
+}
+
+static void
+http_close(struct http_st *h)
+{
+	if (h->tls != NULL) {
+		tls_close(h->tls);
+		tls_free(h->tls);
+		h->tls = NULL;
+	}
+	if (h->fd != -1) {
+		close(h->fd);
+		h->fd = -1;
+	}
+	if (h->res0 != NULL) {
+		if (!h->res_shared)
+			freeaddrinfo(h->res0);
+		h->res0 = h->res = NULL;
+	}
+}
+
+/* readies the request for h->path to be sent */
+static int
+http_request(struct http_st *h)
+{
+	int n;
+
+	n = snprintf(h->head, sizeof(h->head),
+	    "GET %s HTTP/1.1\r\n"
+	    "Host: %s\r\n"
+	    "User-Agent: pkg_ping\r\n"
+	    "%s"
+	    "%s"
+	    "\r\n", h->path, h->host,
+	    (h->keep) ? "" : "Connection: close\r\n",
+	    (h->extra != NULL) ? h->extra : "");
+	if (n < 0 || (size_t)n >= sizeof(h->head))
+		return -1;
+	h->head_len = n;
+	h->head_off = 0;
+
+	h->length = -1;
+	h->range_off = 0;
+	h->range_total = -1;
+	h->got = 0;
+	h->chunked = 0;
+	h->chunk = 0;
+	h->reusable = 0;
+	return 0;
+}
+
+/*
+ * resolves and connects to 'url'. Returns -1 if the probe could not
+ * even be started, otherwise the caller waits for h->fd to be writable.
+ */
+static int
+http_start(struct http_st *h, const char *url, struct tls_config *tls_cfg)
+{
+	struct addrinfo hints;
+	struct dns_st *d;
+
+	http_close(h);
+	h->state = HTTP_FAIL;
+	h->tls_cfg = tls_cfg;
+	h->status = 0;
+	h->reused = 0;
+
+	if (http_split(h, url) == -1)
+		return -1;
+	if (h->https && tls_cfg == NULL)
+		return -1;
+
+	/* a host dns_prefetch() looked up costs nothing here */
+	d = dns_find(h->dns_cache, h->dns_cache_len, h->host, h->port);
+	if (d != NULL) {
+		if (d->res0 == NULL)
+			return -1;
+		h->res0 = d->res0;
+		h->res_shared = 1;
+		h->dns_cached += d->time;
+	} else {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(h->host, h->port, &hints, &h->res0) != 0) {
+			h->res0 = NULL;
+			return -1;
+		}
+		h->res_shared = 0;
+	}
+	http_mark(h, &h->dns);
+	h->res = h->res0;
+	if (http_connect(h) == -1)
+		return -1;
+
+	if (http_request(h) == -1)
+		return -1;
+	h->state = HTTP_CONNECT;
+	return 0;
+}
+
+/* a fresh request for 'url', as opposed to following a redirect */
+static int
+http_get(struct http_st *h, const char *url, struct tls_config *tls_cfg)
+{
+	h->redirects = 0;
+	h->dns = h->connect = h->handshake = h->ttfb = 0;
+	h->dns_cached = 0;
+	clock_gettime(CLOCK_MONOTONIC, &h->mark);
+	return http_start(h, url, tls_cfg);
+}
+
+/*
+ * like http_get(), but over fd and tls, kept alive from an earlier
+ * request to the same host, which it takes ownership of. There is no
+ * connection or TLS handshake to time, so it goes straight to sending.
+ */
+static int
+http_reuse(struct http_st *h, const char *url, struct tls_config *tls_cfg,
+    int fd, struct tls *tls)
+{
+	http_close(h);
+	h->fd = fd;
+	h->tls = tls;
+	h->tls_cfg = tls_cfg;
+	h->state = HTTP_FAIL;
+	h->status = 0;
+	h->redirects = 0;
+	h->dns = h->connect = h->handshake = h->ttfb = 0;
+	h->dns_cached = 0;
+	clock_gettime(CLOCK_MONOTONIC, &h->mark);
+
+	if (http_split(h, url) == -1 || http_request(h) == -1)
+		return -1;
+	h->reused = 1;
+	h->state = HTTP_SEND;
+	return 0;
+}
+
+/*
+ * the server has closed the kept-alive connection before answering,
+ * as it may at any time: the request starts over on a new one
+ */
+static int
+http_redial(struct http_st *h)
+{
+	char *url;
+	int r;
+
+	if (asprintf(&url, "%s://%s%s%s%s%s",
+	    (h->https) ? "https" : "http",
+	    (strchr(h->host, ':') != NULL) ? "[" : "", h->host,
+	    (strchr(h->host, ':') != NULL) ? "]:" : ":",
+	    h->port, h->path) == -1)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &h->mark);
+	r = http_start(h, url, h->tls_cfg);
+	free(url);
+	return r;
+}
+
+static ssize_t
+http_read(struct http_st *h, char *buf, size_t len)
+{
+	ssize_t r;
+
+	if (h->tls != NULL) {
+		r = tls_read(h->tls, buf, len);
+		if (r == TLS_WANT_POLLIN)
+			return HTTP_WANT_READ;
+		if (r == TLS_WANT_POLLOUT)
+			return HTTP_WANT_WRITE;
+		return r;
+	}
+	r = read(h->fd, buf, len);
+	if (r == -1 && errno == EAGAIN)
+		return HTTP_WANT_READ;
+	return r;
+}
+
+static ssize_t
+http_write(struct http_st *h, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	if (h->tls != NULL) {
+		r = tls_write(h->tls, buf, len);
+		if (r == TLS_WANT_POLLIN)
+			return HTTP_WANT_READ;
+		if (r == TLS_WANT_POLLOUT)
+			return HTTP_WANT_WRITE;
+		return r;
+	}
+	r = write(h->fd, buf, len);
+	if (r == -1 && errno == EAGAIN)
+		return HTTP_WANT_WRITE;
+	return r;
+}
+
+/* consumes body bytes, tracking Content-Length or chunked framing */
+static void
+http_body(struct http_st *h, const char *buf, size_t len)
+{
+	size_t n;
+
+	if (!h->chunked) {
+		if (h->length != -1 && (long long)len > h->length - h->got)
+			len = h->length - h->got;
+		if (h->sink != NULL)
+			h->sink(h->sink_arg, buf, len);
+		h->got += len;
+		if (h->length != -1 && h->got >= h->length)
+			h->state = HTTP_DONE;
+		else if (h->cap > 0 && h->got >= h->cap) {
+			/* the rest of the body is still on its way */
+			h->state = HTTP_DONE;
+			h->reusable = 0;
+		}
+		return;
+	}
+
+	while (len > 0 && h->state == HTTP_BODY) {
+		switch (h->chunk_state) {
+		case CHUNK_SIZE:
+			if (*buf == '\n') {
+				h->chunk_state = (h->chunk == 0) ?
+				    CHUNK_TRAILER : CHUNK_DATA;
+				h->chunk_line = 0;
+			} else if (*buf == ';' || h->chunk_line == -1)
+				h->chunk_line = -1;
+			else if (isxdigit((unsigned char)*buf)) {
+				if (h->chunk > LLONG_MAX / 16) {
+					h->state = HTTP_FAIL;
+					return;
+				}
+				h->chunk = h->chunk * 16 +
+				    (isdigit((unsigned char)*buf) ? *buf - '0' :
+				    tolower((unsigned char)*buf) - 'a' + 10);
+			} else if (*buf != '\r' && *buf != ' ') {
+				h->state = HTTP_FAIL;
+				return;
+			}
+			++buf;
+			--len;
+			break;
+		case CHUNK_DATA:
+			n = (len < (unsigned long long)h->chunk) ?
+			    len : (size_t)h->chunk;
+			if (h->sink != NULL)
+				h->sink(h->sink_arg, buf, n);
+			h->got += n;
+			h->chunk -= n;
+			buf += n;
+			len -= n;
+			if (h->chunk == 0)
+				h->chunk_state = CHUNK_CRLF;
+			if (h->cap > 0 && h->got >= h->cap) {
+				h->state = HTTP_DONE;
+				h->reusable = 0;
+			}
+			break;
+		case CHUNK_CRLF:
+			if (*buf == '\n')
+				h->chunk_state = CHUNK_SIZE;
+			++buf;
+			--len;
+			break;
+		case CHUNK_TRAILER:
+			/* an empty line ends the trailer */
+			if (*buf == '\n') {
+				if (h->chunk_line == 0)
+					h->state = HTTP_DONE;
+				h->chunk_line = 0;
+			} else if (*buf != '\r')
+				h->chunk_line = 1;
+			++buf;
+			--len;
+			break;
+		}
+	}
+}
+
+/* returns -1 if the response header is unusable */
+static int
+http_header(struct http_st *h, char *end)
+{
+	char *line, *next, *v, *location = NULL, *slash, code[4];
+	const char *errstr;
+	int8_t close_delimited = 1, conn_close = 0, conn_keep = 0;
+
+	*end = '\0';
+
+	if (strncmp(h->head, "HTTP/1.", 7) || h->head[8] != ' ')
+		return -1;
+	memcpy(code, h->head + 9, 3);
+	code[3] = '\0';
+	h->status = strtonum(code, 100, 999, &errstr);
+	if (errstr != NULL)
+		return -1;
+
+	line = strchr(h->head + 9, '\n');
+	for (; line != NULL; line = next) {
+		++line;
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next = '\0';
+		v = strchr(line, ':');
+		if (v == NULL)
+			continue;
+		*v++ = '\0';
+		while (*v == ' ' || *v == '\t')
+			++v;
+		v[strcspn(v, "\r")] = '\0';
+
+		if (!strcasecmp(line, "Content-Length")) {
+			h->length = strtonum(v, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				return -1;
+			close_delimited = 0;
+		} else if (!strcasecmp(line, "Transfer-Encoding")) {
+			if (strcasecmp(v, "chunked"))
+				return -1;
+			h->chunked = 1;
+			h->chunk_state = CHUNK_SIZE;
+			h->chunk_line = 0;
+			close_delimited = 0;
+		} else if (!strcasecmp(line, "Content-Range")) {
+			/* "bytes first-last/total", the total may be "*" */
+			slash = strchr(v, '/');
+			if (strncmp(v, "bytes ", 6) || slash == NULL)
+				continue;
+			*slash++ = '\0';
+			v[6 + strcspn(v + 6, "-")] = '\0';
+			h->range_off = strtonum(v + 6, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				return -1;
+			h->range_total = strtonum(slash, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				h->range_total = -1;
+		} else if (!strcasecmp(line, "Location"))
+			location = v;
+		else if (!strcasecmp(line, "ETag")) {
+			free(h->etag);
+			if ((h->etag = strdup(v)) == NULL)
+				return -1;
+		} else if (!strcasecmp(line, "Last-Modified")) {
+			free(h->modified);
+			if ((h->modified = strdup(v)) == NULL)
+				return -1;
+		} else if (!strcasecmp(line, "Connection")) {
+			conn_close = !strcasecmp(v, "close");
+			conn_keep = !strcasecmp(v, "keep-alive");
+		}
+	}
+
+	if (h->status >= 300 && h->status < 400 && h->status != 304 &&
+	    location != NULL) {
+		if (++h->redirects > 5)
+			return -1;
+		if (*location == '/') {
+			/* keep the scheme and authority of the last URL */
+			if (asprintf(&v, "%s://%s%s%s%s%s",
+			    (h->https) ? "https" : "http",
+			    (strchr(h->host, ':') != NULL) ? "[" : "", h->host,
+			    (strchr(h->host, ':') != NULL) ? "]:" : ":",
+			    h->port, location) == -1)
+				return -1;
+		} else if ((v = strdup(location)) == NULL)
+			return -1;
+
+		/* the rest of the 3xx response is counted as transfer */
+		clock_gettime(CLOCK_MONOTONIC, &h->mark);
+		if (http_start(h, v, h->tls_cfg) == -1) {
+			free(v);
+			return -1;
+		}
+		free(v);
+		return 0;
+	}
+
+	/* a 304 has no body, whatever the header says */
+	if (h->status == 304)
+		h->length = 0;
+	else if (h->chunked)
+		h->length = -1;
+	else if (close_delimited)
+		h->length = -1;
+	h->state = (h->length == 0) ? HTTP_DONE : HTTP_BODY;
+
+	/* HTTP/1.1 keeps the connection open unless it says otherwise */
+	h->reusable = h->keep && !close_delimited &&
+	    ((h->head[7] == '1') ? !conn_close : conn_keep);
+	return 0;
+}
+
+/*
+ * moves a request along as far as it can go without blocking. It
+ * returns HTTP_WANT_READ or HTTP_WANT_WRITE for the event to wait on,
+ * or 0 once h->state is HTTP_DONE or HTTP_FAIL.
+ */
+static int
+http_step(struct http_st *h)
+{
+	char buf[16384], *end;
+	ssize_t r;
+	socklen_t len;
+	int error;
+
+	for (;;) {
+		switch (h->state) {
+		case HTTP_CONNECT:
+			len = sizeof(error);
+			if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &error,
+			    &len) == -1 || error != 0) {
+				close(h->fd);
+				h->fd = -1;
+				h->res = h->res->ai_next;
+				if (http_connect(h) == -1) {
+					h->state = HTTP_FAIL;
+					break;
+				}
+				return HTTP_WANT_WRITE;
+			}
+			http_mark(h, &h->connect);
+			if (!h->https) {
+				h->state = HTTP_SEND;
+				break;
+			}
+			h->tls = tls_client();
+			if (h->tls == NULL ||
+			    tls_configure(h->tls, h->tls_cfg) == -1 ||
+			    tls_connect_socket(h->tls, h->fd, h->host) == -1) {
+				h->state = HTTP_FAIL;
+				break;
+			}
+			h->state = HTTP_HANDSHAKE;
+			break;
+		case HTTP_HANDSHAKE:
+			r = tls_handshake(h->tls);
+			if (r == TLS_WANT_POLLIN)
+				return HTTP_WANT_READ;
+			if (r == TLS_WANT_POLLOUT)
+				return HTTP_WANT_WRITE;
+			h->state = (r == 0) ? HTTP_SEND : HTTP_FAIL;
+			http_mark(h, &h->handshake);
+			break;
+		case HTTP_SEND:
+			r = http_write(h, h->head + h->head_off,
+			    h->head_len - h->head_off);
+			if (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE)
+				return r;
+			if (r <= 0) {
+				if (h->reused && http_redial(h) == 0)
+					return HTTP_WANT_WRITE;
+				h->state = HTTP_FAIL;
+				break;
+			}
+			h->head_off += r;
+			if (h->head_off == h->head_len) {
+				h->head_len = 0;
+				h->state = HTTP_HEADER;
+			}
+			break;
+		case HTTP_HEADER:
+			if (h->head_len >= sizeof(h->head) - 1) {
+				h->state = HTTP_FAIL;
+				break;
+			}
+			r = http_read(h, h->head + h->head_len,
+			    sizeof(h->head) - 1 - h->head_len);
+			if (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE)
+				return r;
+			if (r <= 0) {
+				if (h->reused && h->head_len == 0 &&
+				    http_redial(h) == 0)
+					return HTTP_WANT_WRITE;
+				h->state = HTTP_FAIL;
+				break;
+			}
+			if (h->head_len == 0)
+				http_mark(h, &h->ttfb);
+			h->head_len += r;
+			h->head[h->head_len] = '\0';
+			end = strstr(h->head, "\r\n\r\n");
+			if (end == NULL)
+				break;
+
+			/* whatever follows the header is body */
+			r = h->head_len - (end + 4 - h->head);
+			memcpy(buf, end + 4, r);
+			if (http_header(h, end + 2) == -1) {
+				h->state = HTTP_FAIL;
+				break;
+			}
+			if (h->state == HTTP_CONNECT)
+				return HTTP_WANT_WRITE;
+			if (h->state == HTTP_BODY && r > 0)
+				http_body(h, buf, r);
+			break;
+		case HTTP_BODY:
+			r = http_read(h, buf, sizeof(buf));
+			if (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE)
+				return r;
+			if (r == 0 && h->length == -1 && !h->chunked) {
+				h->state = HTTP_DONE;
+				break;
+			}
+			if (r <= 0) {
+				h->state = HTTP_FAIL;
+				break;
+			}
+			http_body(h, buf, r);
+			break;
+		default:
+			return 0;
+		}
+	}
+}
+
+/*
+ * how much of the -m metric a probe in flight has used up so far. It can
+ * only grow from here, and *growing says whether it is growing now.
+ */
+static double
+probe_spent(struct probe_st *p, int metric, struct timespec *now,
+    int *growing)
+{
+	struct http_st *h = &p->http;
+	double phase = ts_elapsed(&h->mark, now);
+
+	switch (metric) {
+	case METRIC_TTFB:
+		*growing = (h->state == HTTP_SEND ||
+		    (h->state == HTTP_HEADER && h->head_len == 0));
+		return h->ttfb + ((*growing) ? phase : 0);
+	case METRIC_CONNECT:
+		*growing = (h->state == HTTP_CONNECT);
+		return h->connect + ((*growing) ? phase : 0);
+	case METRIC_RATE:
+		*growing = (h->state == HTTP_BODY ||
+		    (h->state == HTTP_HEADER && h->head_len > 0));
+		if (!*growing)
+			return 0;
+		return ts_elapsed(&p->start, now) - h->dns - h->connect -
+		    h->handshake - h->ttfb;
+	default:
+		*growing = 1;
+		return ts_elapsed(&p->start, now);
+	}
+}
+
+/* moves a lookup along, returns 0 once it is done */
+static int
+dns_step(struct dns_st *d, int kq, struct timespec *now)
+{
+	struct asr_result ar;
+
+	if (asr_run(d->q, &ar) == 1) {
+		d->q = NULL;
+		d->res0 = ar.ar_addrinfo;
+		d->error = ar.ar_gai_errno;
+		if (d->error != 0)
+			d->res0 = NULL;
+		d->time = ts_elapsed(&d->start, now);
+		return 0;
+	}
+
+	if (ev_add(kq, ar.ar_fd, (ar.ar_cond == ASR_WANT_READ) ?
+	    EVENT_READ : EVENT_WRITE, d) == -1) {
+		asr_abort(d->q);
+		d->q = NULL;
+		d->error = EAI_SYSTEM;
+		return 0;
+	}
+	d->deadline = *now;
+	d->deadline.tv_sec += ar.ar_timeout / 1000;
+	d->deadline.tv_nsec += (ar.ar_timeout % 1000) * 1000000L;
+	if (d->deadline.tv_nsec >= 1000000000L) {
+		++d->deadline.tv_sec;
+		d->deadline.tv_nsec -= 1000000000L;
+	}
+	return 1;
+}
+
+/*
+ * looks up the host of every mirror at once with asr(3) on the event
+ * queue, each host only once, so that the probes don't time the resolver. A
+ * lookup which takes longer than s fails. Returns the table, sorted for
+ * dns_find(), or NULL.
+ */
+static struct dns_st *
+dns_prefetch(struct mirror_st **array, int length, int *len, int kq,
+    double s)
+{
+	struct dns_st *d;
+	struct http_st h;
+	struct addrinfo hints;
+	struct event_st *kev;
+	struct timespec now, timeout, begin;
+	double wait, left;
+	int c, i, n = 0, pending = 0;
+
+	d = calloc(length, sizeof(struct dns_st));
+	kev = calloc(length, sizeof(struct event_st));
+	if (d == NULL || kev == NULL)
+		return NULL;
+
+	memset(&h, 0, sizeof(h));
+	for (c = 0; c < length; ++c) {
+		if (http_split(&h, array[c]->ftp_file) == -1)
+			continue;
+		d[n].kind = UDATA_DNS;
+		d[n].host = strdup(h.host);
+		d[n].port = strdup(h.port);
+		if (d[n].host == NULL || d[n].port == NULL)
+			return NULL;
+		++n;
+	}
+	free(h.url);
+	free(h.path);
+
+	/* http and https mirrors often share a host */
+	qsort(d, n, sizeof(struct dns_st), dns_cmp);
+	for (c = i = 0; c < n; ++c) {
+		if (i > 0 && !dns_cmp(&d[i - 1], &d[c])) {
+			free(d[c].host);
+			free(d[c].port);
+			continue;
+		}
+		d[i++] = d[c];
+	}
+	n = i;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (c = 0; c < n; ++c) {
+		d[c].start = begin;
+		d[c].q = getaddrinfo_async(d[c].host, d[c].port, &hints, NULL);
+		if (d[c].q == NULL)
+			d[c].error = EAI_SYSTEM;
+		else
+			pending += dns_step(&d[c], kq, &begin);
+	}
+
+	while (pending > 0) {
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = s - ts_elapsed(&begin, &now);
+		for (c = 0; c < n; ++c) {
+			if (d[c].q == NULL)
+				continue;
+			left = ts_elapsed(&now, &d[c].deadline);
+			if (left < wait)
+				wait = left;
+		}
+		if (wait < 0)
+			wait = 0;
+		timeout.tv_sec = (time_t) wait;
+		timeout.tv_nsec = (long) ((wait - (double) timeout.tv_sec) *
+		    1000000000.0);
+
+		i = ev_wait(kq, kev, n, &timeout);
+		if (i == -1)
+			return NULL;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (c = 0; c < i; ++c) {
+			struct dns_st *p = kev[c].udata;
+
+			if (p->q != NULL && dns_step(p, kq, &now) == 0)
+				--pending;
+		}
+
+		/* asr(3) retries or gives up when it is run late */
+		for (c = 0; c < n; ++c) {
+			if (d[c].q == NULL ||
+			    ts_elapsed(&d[c].deadline, &now) < 0)
+				continue;
+			if (dns_step(&d[c], kq, &now) == 0)
+				--pending;
+		}
+
+		if (ts_elapsed(&begin, &now) < s)
+			continue;
+		for (c = 0; c < n; ++c) {
+			if (d[c].q == NULL)
+				continue;
+			asr_abort(d[c].q);
+			d[c].q = NULL;
+			d[c].error = EAI_AGAIN;
+		}
+		pending = 0;
+	}
+
+	free(kev);
+	*len = n;
+	return d;
+}
+
+static void
+dns_free(struct dns_st *d, int len)
+{
+	int c;
+
+	for (c = 0; c < len; ++c) {
+		if (d[c].res0 != NULL)
+			freeaddrinfo(d[c].res0);
+		free(d[c].host);
+		free(d[c].port);
+	}
+	free(d);
+}
+
+/* closes the connection kept alive for m, returns how many it closed */
+static int
+idle_close(struct mirror_st *m)
+{
+	if (m->idle_fd == -1)
+		return 0;
+	if (m->idle_tls != NULL) {
+		tls_close(m->idle_tls);
+		tls_free(m->idle_tls);
+		m->idle_tls = NULL;
+	}
+	close(m->idle_fd);
+	m->idle_fd = -1;
+	return 1;
+}
+
+/*
+ * -P: opens a TCP connection to up to 'open_max' mirrors at a time and
+ * times the handshake. Nothing is sent. Once 'keep' mirrors have
+ * connected, the rest get only as long as the slowest of those took.
+ * The array is left sorted on connect time and the number of mirrors
+ * worth keeping is returned.
+ */
+static int
+connect_scan(struct mirror_st **array, int length, int keep, int open_max,
+    int kq, double s, struct tls_config *tls_cfg, struct dns_st *dns,
+    int dns_len)
+{
+	struct http_st *h;
+	struct event_st *kev;
+	struct timespec now, timeout;
+	double wait, left, t, *best;
+	int c, i, j, k, *index, launched = 0, pending = 0, done = 0, error;
+	socklen_t len;
+
+	h = calloc(open_max, sizeof(struct http_st));
+	index = calloc(open_max, sizeof(int));
+	kev = calloc(open_max, sizeof(struct event_st));
+	best = calloc(keep, sizeof(double));
+	if (h == NULL || index == NULL || kev == NULL || best == NULL)
+		return -1;
+	for (k = 0; k < open_max; ++k) {
+		h[k].fd = -1;
+		h[k].dns_cache = dns;
+		h[k].dns_cache_len = dns_len;
+	}
+	for (c = 0; c < length; ++c)
+		array[c]->connect = -1;
+
+	while (launched < length || pending > 0) {
+
+		for (k = 0; k < open_max && launched < length; ++k) {
+			if (h[k].fd != -1)
+				continue;
+			index[k] = launched++;
+
+			/* h[k].mark is set once the name is looked up */
+			if (http_get(&h[k], array[index[k]]->ftp_file,
+			    tls_cfg) == -1) {
+				http_close(&h[k]);
+				continue;
+			}
+			if (ev_add(kq, h[k].fd, EVENT_WRITE, &h[k]) == -1)
+				return -1;
+			++pending;
+		}
+		if (pending == 0)
+			continue;
+
+		/* the keep'th fastest connect so far bounds the rest */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = -1;
+		for (k = 0; k < open_max; ++k) {
+			if (h[k].fd == -1)
+				continue;
+			left = ((done >= keep) ? best[keep - 1] : s) -
+			    ts_elapsed(&h[k].mark, &now);
+			if (left < 0)
+				left = 0;
+			if (wait == -1 || left < wait)
+				wait = left;
+		}
+		timeout.tv_sec = (time_t) wait;
+		timeout.tv_nsec = (long) ((wait - (double) timeout.tv_sec) *
+		    1000000000.0);
+
+		i = ev_wait(kq, kev, open_max, &timeout);
+		if (i == -1)
+			return -1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (j = 0; j < i; ++j) {
+			k = (struct http_st *) kev[j].udata - h;
+
+			len = sizeof(error);
+			if (getsockopt(h[k].fd, SOL_SOCKET, SO_ERROR, &error,
+			    &len) == -1 || error != 0) {
+				close(h[k].fd);
+				h[k].fd = -1;
+				h[k].res = h[k].res->ai_next;
+				if (http_connect(&h[k]) == 0) {
+					if (ev_add(kq, h[k].fd, EVENT_WRITE,
+					    &h[k]) == -1)
+						return -1;
+					continue;
+				}
+			} else {
+				t = ts_elapsed(&h[k].mark, &now);
+				array[index[k]]->connect = t;
+
+				/* keep the fastest 'keep' in order */
+				c = (done < keep) ? done : keep - 1;
+				if (done < keep || t < best[c]) {
+					for (; c > 0 && best[c - 1] > t; --c)
+						best[c] = best[c - 1];
+					best[c] = t;
+				}
+				++done;
+			}
+			http_close(&h[k]);
+			--pending;
+		}
+
+		/* too slow to make the cut, or to connect at all */
+		for (k = 0; k < open_max; ++k) {
+			if (h[k].fd == -1)
+				continue;
+			left = ((done >= keep) ? best[keep - 1] : s) -
+			    ts_elapsed(&h[k].mark, &now);
+			if (left > 0)
+				continue;
+			http_close(&h[k]);
+			--pending;
+		}
+	}
+
+	for (k = 0; k < open_max; ++k) {
+		free(h[k].url);
+		free(h[k].path);
+	}
+	free(h);
+	free(index);
+	free(kev);
+	free(best);
+
+	qsort(array, length, sizeof(struct mirror_st *), connect_cmp);
+	return (done < keep) ? done : keep;
+}
+
+static void *
+arena_alloc(struct arena_st *a, size_t n)
+{
+	char *block;
+	size_t size;
+
+	/* the first 16 bytes hold the link and keep doubles aligned */
+	n = (n + 15) & ~(size_t)15;
+	if (a->block == NULL || n > a->size - a->used) {
+		size = (n + 16 > ARENA_BLOCK) ? n + 16 : ARENA_BLOCK;
+		block = malloc(size);
+		if (block == NULL)
+			return NULL;
+		*(char **)block = a->block;
+		a->block = block;
+		a->used = 16;
+		a->size = size;
+	}
+	a->used += n;
+	return a->block + a->used - n;
+}
+
+static void
+arena_free(struct arena_st *a)
+{
+	char *prev;
+
+	while (a->block != NULL) {
+		prev = *(char **)a->block;
+		free(a->block);
+		a->block = prev;
+	}
+	memset(a, 0, sizeof(struct arena_st));
+}
+
+/* FNV-1a */
+static size_t
+intern_hash(const char *s)
+{
+	size_t h = 2166136261U;
+
+	for (; *s != '\0'; ++s)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h;
+}
+
+/*
+ * returns the one copy of s in the arena, adding it if it is new. *dup
+ * says whether it was there already.
+ */
+static char *
+intern(struct intern_st *t, struct arena_st *a, const char *s, int8_t *dup)
+{
+	char **slot, *p;
+	void **val;
+	size_t i, k, max, n;
+
+	/* kept at most half full, so that probing stays short */
+	if (2 * (t->len + 1) > t->max) {
+		max = (t->max == 0) ? 256 : 2 * t->max;
+		slot = calloc(max, sizeof(char *));
+		val = calloc(max, sizeof(void *));
+		if (slot == NULL || val == NULL) {
+			free(slot);
+			free(val);
+			return NULL;
+		}
+		for (k = 0; k < t->max; ++k) {
+			if (t->slot[k] == NULL)
+				continue;
+			for (i = intern_hash(t->slot[k]) & (max - 1);
+			    slot[i] != NULL; i = (i + 1) & (max - 1))
+				;
+			slot[i] = t->slot[k];
+			val[i] = t->val[k];
+		}
+		free(t->slot);
+		free(t->val);
+		t->slot = slot;
+		t->val = val;
+		t->max = max;
+	}
+
+	for (i = intern_hash(s) & (t->max - 1); t->slot[i] != NULL;
+	    i = (i + 1) & (t->max - 1)) {
+		if (!strcmp(t->slot[i], s)) {
+			*dup = 1;
+			return t->slot[i];
+		}
+	}
+
+	n = strlen(s) + 1;
+	p = arena_alloc(a, n);
+	if (p == NULL)
+		return NULL;
+	memcpy(p, s, n);
+	t->slot[i] = p;
+	++t->len;
+	*dup = 0;
+	return p;
+}
+
+/* where the caller's pointer for p, as intern() returned it, is kept */
+static void **
+intern_val(struct intern_st *t, const char *p)
+{
+	size_t i;
+
+	for (i = intern_hash(p) & (t->max - 1); t->slot[i] != p;
+	    i = (i + 1) & (t->max - 1))
+		;
+	return &t->val[i];
+}
+
+static void
+intern_free(struct intern_st *t)
+{
+	free(t->slot);
+	free(t->val);
+	memset(t, 0, sizeof(struct intern_st));
+}
+
+/* takes ownership of ftp_file and label, unless it fails */
+static int
+list_add(struct list_st *l, char *ftp_file, char *label)
+{
+	if (l->length >= l->entry_max) {
+		struct mirror_st *entry;
+		int max = (l->entry_max == 0) ? 100 : 2 * l->entry_max;
+
+		entry = reallocarray(l->entry, max, sizeof(struct mirror_st));
+		if (entry == NULL)
+			return -1;
+		l->entry = entry;
+		l->entry_max = max;
+	}
+
+	memset(&l->entry[l->length], 0, sizeof(struct mirror_st));
+	l->entry[l->length].ftp_file = ftp_file;
+	l->entry[l->length].label = label;
+	++l->length;
+	return 0;
+}
+
+/*
+ * Reduces ftp.html to its label and URL pairs as the page streams in,
+ * the way this sed script did from an ftp(1) pipe:
+ *
+ *	sed -n -e 's:</a>$::' \
+ *	    -e 's:\t<strong>\([^<]*\)<.*:\1:p' \
+ *	    -e 's:^\(\t[hfr].*\):\1:p'
+ *
+ * The pairs are kept as published; -u and -S are applied afterwards.
+ */
+static int
+list_line(struct list_st *l, const char *p, size_t n)
+{
+	const char *q, *e;
+	char *s;
+
+	if (n >= 4 && !memcmp(p + n - 4, "</a>", 4))
+		n -= 4;
+
+	q = memmem(p, n, "\t<strong>", 9);
+	if (q != NULL) {
+		e = memchr(q + 9, '<', p + n - (q + 9));
+		if (e == NULL)
+			return 0;
+
+		/* sed keeps whatever preceded the match */
+		s = malloc((q - p) + (e - (q + 9)) + 1);
+		if (s == NULL)
+			return -1;
+		memcpy(s, p, q - p);
+		memcpy(s + (q - p), q + 9, e - (q + 9));
+		s[(q - p) + (e - (q + 9))] = '\0';
+
+		free(l->label);
+		l->label = s;
+		return 0;
+	}
+
+	if (n < 2 || p[0] != '\t')
+		return 0;
+
+	/* rsync mirrors are listed last and are of no use */
+	if (p[1] == 'r') {
+		l->stop = 1;
+		return 0;
+	}
+	if (p[1] != 'h' && p[1] != 'f')
+		return 0;
+
+	/* a URL belongs to the label before it */
+	if (l->label == NULL)
+		return 0;
+
+	++p;
+	--n;
+	if (p[n - 1] == '/')
+		--n;
+
+	s = malloc(n + 1);
+	if (s == NULL)
+		return -1;
+	memcpy(s, p, n);
+	s[n] = '\0';
+
+	if (list_add(l, s, l->label) == -1) {
+		free(s);
+		return -1;
+	}
+	l->label = NULL;
+	return 0;
+}
+
+/* the http_st.sink for ftp.html: whole lines are parsed in place */
+static void
+list_feed(void *arg, const char *buf, size_t len)
+{
+	struct list_st *l = arg;
+	const char *e;
+	char *line;
+	size_t n;
+
+	while (len > 0 && !l->stop && !l->error) {
+
+		e = memchr(buf, '\n', len);
+		n = (e == NULL) ? len : (size_t)(e - buf);
+
+		/* a line split across blocks is gathered in l->line */
+		if (e == NULL || l->len > 0) {
+			if (l->len + n > l->max) {
+				line = realloc(l->line, l->len + n + 256);
+				if (line == NULL) {
+					l->error = 1;
+					return;
+				}
+				l->line = line;
+				l->max = l->len + n + 256;
+			}
+			memcpy(l->line + l->len, buf, n);
+			l->len += n;
+			if (e == NULL)
+				return;
+			if (list_line(l, l->line, l->len) == -1)
+				l->error = 1;
+			l->len = 0;
+		} else if (list_line(l, buf, n) == -1)
+			l->error = 1;
+
+		buf += n + 1;
+		len -= n + 1;
+	}
+}
+
+/* sed also prints a last line which has no newline */
+static void
+list_end(struct list_st *l)
+{
+	if (l->len > 0 && !l->stop && !l->error) {
+		if (list_line(l, l->line, l->len) == -1)
+			l->error = 1;
+	}
+	l->len = 0;
+}
+
+/*
+ * LIST_PATH holds the ETag and Last-Modified lines of the ftp.html it
+ * was parsed from, an empty line and then a "URL label" line for each
+ * mirror, in the order they were published. A -l file, read with a
+ * NULL etag, only has the "URL label" lines, and '#' comments.
+ */
+static int
+list_read(struct list_st *l, const char *path, char **etag,
+    char **modified)
+{
+	FILE *fp;
+	char *line = NULL, *v, *ftp_file, *label;
+	size_t line_max = 0;
+	ssize_t n;
+	int8_t header = (etag != NULL);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	while ((n = getline(&line, &line_max, fp)) != -1) {
+		if (n > 0 && line[n - 1] == '\n')
+			line[--n] = '\0';
+
+		if (header) {
+			if (n == 0) {
+				header = 0;
+				continue;
+			}
+			v = strchr(line, ' ');
+			if (v == NULL)
+				continue;
+			*v++ = '\0';
+			if (!strcmp(line, "ETag")) {
+				free(*etag);
+				*etag = strdup(v);
+			} else if (!strcmp(line, "Last-Modified")) {
+				free(*modified);
+				*modified = strdup(v);
+			}
+			continue;
+		}
+
+		if (n == 0 || *line == '#')
+			continue;
+		v = strchr(line, ' ');
+		if (v == NULL)
+			continue;
+		*v++ = '\0';
+		if (v - line > 2 && v[-2] == '/')
+			v[-2] = '\0';
+		ftp_file = strdup(line);
+		label = strdup(v);
+		if (ftp_file == NULL || label == NULL ||
+		    list_add(l, ftp_file, label) == -1) {
+			free(ftp_file);
+			free(label);
+			break;
+		}
+	}
+	free(line);
+	fclose(fp);
+	return (l->length > 0) ? 0 : -1;
+}
+
+static void
+list_write(FILE *fp, struct list_st *l, const char *etag,
+    const char *modified)
+{
+	int c;
+
+	if (etag != NULL)
+		fprintf(fp, "ETag %s\n", etag);
+	if (modified != NULL)
+		fprintf(fp, "Last-Modified %s\n", modified);
+	fprintf(fp, "\n");
+	for (c = 0; c < l->length; ++c)
+		fprintf(fp, "%s %s\n", l->entry[c].ftp_file,
+		    l->entry[c].label);
+}
+
+static void
+list_free(struct list_st *l)
+{
+	int c;
+
+	for (c = 0; c < l->length; ++c) {
+		free(l->entry[c].label);
+		free(l->entry[c].ftp_file);
+	}
+	free(l->entry);
+	free(l->label);
+	free(l->line);
+	memset(l, 0, sizeof(struct list_st));
+}
+
+/*
+ * settles on the list to probe once the fetch of ftp.html from 'url' is
+ * over, or has failed if fail is set: the page as it was sent, or the
+ * one from LIST_PATH if it hadn't changed or didn't arrive whole. A
+ * fresh page goes to the writer child through to_write, unless that is
+ * NULL. Returns 1 if it fell back on the cached list, else 0.
+ */
+static int
+list_settle(struct list_st *list, struct list_st *cache, struct http_st *h,
+    const char *url, int8_t fail, int8_t cached, const char *list_file,
+    int8_t verbose, FILE *to_write, struct trace_st *trace,
+    struct timespec *start)
+{
+	struct timespec now;
+	char args[128];
+	int fell_back = 1;
+
+	if (list->error) {
+		errno = ENOMEM;
+		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+	}
+	if (!fail && h->state == HTTP_DONE && h->status == 304) {
+		if (verbose >= 2) {
+			fprintf(stderr, "ftp.html hasn't changed, using %s\n",
+			    LIST_PATH);
+		}
+		list_free(list);
+		*list = *cache;
+	} else if (fail || (!list->stop &&
+	    (h->state != HTTP_DONE || h->status != 200))) {
+		if (!cached)
+			errx(EXIT_FAILURE, "error fetching: %s", url);
+		if (verbose >= 0 && list_file == NULL) {
+			warnx("couldn't fetch ftp.html, using %s",
+			    LIST_PATH);
+		}
+		list_free(list);
+		*list = *cache;
+	} else {
+		list_end(list);
+		list_free(cache);
+		fell_back = 0;
+
+		/* the list as published, before -u or -S */
+		if (to_write != NULL) {
+			char *list_buf;
+			size_t list_len;
+			FILE *list_out;
+
+			list_out = open_memstream(&list_buf, &list_len);
+			if (list_out == NULL) {
+				err(EXIT_FAILURE, "open_memstream line: %d",
+				    __LINE__);
+			}
+			list_write(list_out, list, h->etag, h->modified);
+			if (fclose(list_out) == EOF)
+				err(EXIT_FAILURE, "fclose line: %d", __LINE__);
+
+			fprintf(to_write, "list %zu\n", list_len);
+			fwrite(list_buf, 1, list_len, to_write);
+			fflush(to_write);
+			free(list_buf);
+		}
+	}
+	if (list_file == NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		snprintf(args, sizeof(args),
+		    "\"status\":%d,\"bytes\":%lld,\"mirrors\":%d",
+		    h->status, h->got, list->length);
+		trace_span(trace, "fetch and parse ftp.html", 0, start, &now,
+		    args);
+	}
+	free(h->etag);
+	free(h->modified);
+	http_close(h);
+	free(h->url);
+	free(h->path);
+	return fell_back;
+}
+
+/*
+ * the URL a list entry is probed at, with -u and -S applied, interned
+ * in urls. *skip is set for an entry which they filter out or which is
+ * in the table already, and NULL is returned for it, or on no memory.
+ */
+static char *
+mirror_url(struct mirror_st *entry, int8_t u, int8_t insecure,
+    struct intern_st *urls, struct arena_st *a, int8_t *skip)
+{
+	char *ftp_file = entry->ftp_file, *http_file = NULL;
+
+	*skip = 1;
+	if (u && !strncmp("USA", entry->label, 3))
+		return NULL;
+
+	if (!insecure) {
+		if (strncmp(ftp_file, "https://", 8))
+			return NULL;
+	} else if (!strncmp(ftp_file, "https", 5))
+		return NULL;
+
+	*skip = 0;
+	if (insecure && !strncmp(ftp_file, "ftp://", 6)) {
+		/* ftp mirrors are reached over http */
+		if (asprintf(&http_file, "http%s", ftp_file + 3) == -1)
+			return NULL;
+		ftp_file = http_file;
+	}
+
+	ftp_file = intern(urls, a, ftp_file, skip);
+	free(http_file);
+	return (*skip) ? NULL : ftp_file;
+}
+
+/* readies m to be probed: room for its -n samples and no connection */
+static int
+mirror_ready(struct mirror_st *m, struct arena_st *a, int samples)
+{
+	m->sample = arena_alloc(a, samples * sizeof(double));
+	if (m->sample == NULL)
+		return -1;
+	m->sample_len = 0;
+	m->idle_fd = -1;
+	m->idle_tls = NULL;
+	m->cold = m->warm = 0;
+	m->warm_len = 0;
+	return 0;
+}
+
+/*
+ * builds the mirror table out of the list, with -u and -S applied: the
+ * mirrors lie side by side in the arena with their strings interned, so
+ * a URL which is already in it, eg. an ftp mirror which is listed over
+ * http as well, is dropped as it is met. Returns NULL if out of memory.
+ */
+static struct mirror_st **
+mirror_table(struct list_st *l, int8_t u, int8_t insecure,
+    struct arena_st *a, int *length)
+{
+	struct intern_st urls, labels;
+	struct mirror_st *table, **array;
+	char *ftp_file;
+	int8_t dup;
+	int c;
+
+	memset(&urls, 0, sizeof(urls));
+	memset(&labels, 0, sizeof(labels));
+	*length = 0;
+
+	table = arena_alloc(a, (l->length + 1) * sizeof(struct mirror_st));
+	array = calloc(l->length + 1, sizeof(struct mirror_st *));
+	if (table == NULL || array == NULL)
+		return NULL;
+
+	for (c = 0; c < l->length; ++c) {
+
+		ftp_file = mirror_url(&l->entry[c], u, insecure, &urls, a,
+		    &dup);
+		if (dup)
+			continue;
+		if (ftp_file == NULL)
+			return NULL;
+
+		memset(&table[*length], 0, sizeof(struct mirror_st));
+		table[*length].ftp_file = ftp_file;
+		table[*length].label = intern(&labels, a, l->entry[c].label,
+		    &dup);
+		if (table[*length].label == NULL)
+			return NULL;
+		array[*length] = &table[*length];
+		++*length;
+	}
+
+	intern_free(&urls);
+	intern_free(&labels);
+	return array;
+}
+
+static int
+hist_cmp(const void *a, const void *b)
+{
+	struct hist_st *one = (struct hist_st *) a;
+	struct hist_st *two = (struct hist_st *) b;
+
+	return strcmp(one->ftp_file, two->ftp_file);
+}
+
+static int
+hist_ewma_cmp(const void *a, const void *b)
+{
+	struct mirror_st **one = (struct mirror_st **) a;
+	struct mirror_st **two = (struct mirror_st **) b;
+
+	if ((*one)->hist->ewma < (*two)->hist->ewma)
+		return -1;
+	if ((*one)->hist->ewma > (*two)->hist->ewma)
+		return 1;
+	return 0;
+}
+
+/*
+ * reads HIST_PATH, one "ftp_file ewma ok fails seen" line per mirror,
+ * into a table sorted on ftp_file. A missing or unreadable file is an
+ * empty history.
+ */
+static struct hist_st *
+hist_read(int *length)
+{
+	struct hist_st *hist, *h;
+	FILE *fp;
+	char *line = NULL, *ftp_file;
+	size_t line_max = 0;
+	long long seen;
+	int max = 100;
+
+	*length = 0;
+	hist = calloc(max, sizeof(struct hist_st));
+	if (hist == NULL)
+		return NULL;
+
+	fp = fopen(HIST_PATH, "r");
+	if (fp == NULL)
+		return hist;
+
+	while (getline(&line, &line_max, fp) != -1) {
+		if (*length >= max) {
+			h = reallocarray(hist, 2 * max,
+			    sizeof(struct hist_st));
+			if (h == NULL)
+				break;
+			hist = h;
+			max *= 2;
+		}
+		h = &hist[*length];
+		ftp_file = malloc(strlen(line) + 1);
+		if (ftp_file == NULL)
+			break;
+		if (sscanf(line, "%s %lf %d %d %lld", ftp_file, &h->ewma,
+		    &h->ok, &h->fails, &seen) != 5) {
+			free(ftp_file);
+			continue;
+		}
+		h->ftp_file = ftp_file;
+		h->seen = seen;
+		++*length;
+	}
+	free(line);
+	fclose(fp);
+
+	qsort(hist, *length, sizeof(struct hist_st), hist_cmp);
+	return hist;
+}
+
+/*
+ * points each mirror at its record in hist, which is sorted on ftp_file
+ * up to length, adding one past *total for a mirror new to it. What a
+ * mirror kept in a record of its own, as with -e, is carried over.
+ * Returns the table, which may have moved, or NULL.
+ */
+static struct hist_st *
+hist_attach(struct hist_st *hist, int length, int *total,
+    struct mirror_st **array, int array_length)
+{
+	struct hist_st *h, key;
+	int c;
+
+	/* new mirrors are added unsorted past the length records */
+	h = reallocarray(hist, length + array_length, sizeof(struct hist_st));
+	if (h == NULL)
+		return NULL;
+	hist = h;
+	*total = length;
+
+	for (c = 0; c < array_length; ++c) {
+		key.ftp_file = array[c]->ftp_file;
+		h = bsearch(&key, hist, length, sizeof(struct hist_st),
+		    hist_cmp);
+		if (h == NULL) {
+			h = &hist[(*total)++];
+			memset(h, 0, sizeof(struct hist_st));
+			h->ftp_file = array[c]->ftp_file;
+		}
+		if (array[c]->hist != NULL)
+			*h = *array[c]->hist;
+		array[c]->hist = h;
+	}
+	return hist;
+}
+
+/*
+ * -e: adds the entries which came into l since the last call to the
+ * table, filtered and deduplicated as by mirror_table(), and starts the
+ * lookup of each new host on kq. A mirror keeps its history in the
+ * arena for now, as the records in p->hist are moved once the list is
+ * whole. Returns -1 if out of memory.
+ */
+static int
+pipe_take(struct pipe_st *p, struct list_st *l, int kq)
+{
+	struct mirror_st *m, **array;
+	struct hist_st *h, key;
+	struct dns_st *d, **dns;
+	struct http_st http;
+	struct addrinfo hints;
+	struct timespec now;
+	char *name, *host;
+	void **val;
+	int8_t skip;
+	int c, max;
+
+	memset(&http, 0, sizeof(http));
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (; p->taken < l->length; ++p->taken) {
+
+		key.ftp_file = mirror_url(&l->entry[p->taken], p->u,
+		    p->insecure, &p->urls, p->arena, &skip);
+		if (skip)
+			continue;
+		if (key.ftp_file == NULL)
+			return -1;
+
+		if (p->length >= p->max) {
+			max = (p->max == 0) ? 100 : 2 * p->max;
+			array = reallocarray(p->array, max,
+			    sizeof(struct mirror_st *));
+			if (array == NULL)
+				return -1;
+			p->array = array;
+			p->max = max;
+		}
+
+		m = arena_alloc(p->arena, sizeof(struct mirror_st));
+		h = arena_alloc(p->arena, sizeof(struct hist_st));
+		if (m == NULL || h == NULL)
+			return -1;
+		memset(m, 0, sizeof(struct mirror_st));
+		m->ftp_file = key.ftp_file;
+		m->label = intern(&p->labels, p->arena,
+		    l->entry[p->taken].label, &skip);
+		if (m->label == NULL ||
+		    mirror_ready(m, p->arena, p->samples) == -1)
+			return -1;
+
+		m->hist = bsearch(&key, p->hist, p->hist_length,
+		    sizeof(struct hist_st), hist_cmp);
+		if (m->hist != NULL)
+			*h = *m->hist;
+		else {
+			memset(h, 0, sizeof(struct hist_st));
+			h->ftp_file = m->ftp_file;
+		}
+		m->hist = h;
+		m->near = near_tier(m, p->home, time(NULL));
+
+		c = strlen(m->ftp_file) + 1;
+		if (p->url_max < c)
+			p->url_max = c;
+		p->array[p->length++] = m;
+
+		/* a URL which won't split fails when it is probed */
+		if (http_split(&http, m->ftp_file) == -1)
+			continue;
+
+		/* http and https mirrors often share a host */
+		if (asprintf(&name, "%s %s", http.host, http.port) == -1)
+			return -1;
+		host = intern(&p->hosts, p->arena, name, &skip);
+		free(name);
+		if (host == NULL)
+			return -1;
+		val = intern_val(&p->hosts, host);
+		if (skip) {
+			m->lookup = *val;
+			continue;
+		}
+
+		if (p->dns_len >= p->dns_max) {
+			max = (p->dns_max == 0) ? 100 : 2 * p->dns_max;
+			dns = reallocarray(p->dns, max,
+			    sizeof(struct dns_st *));
+			if (dns == NULL)
+				return -1;
+			p->dns = dns;
+			p->dns_max = max;
+		}
+		d = calloc(1, sizeof(struct dns_st));
+		if (d == NULL)
+			return -1;
+		p->dns[p->dns_len++] = d;
+		*val = d;
+		d->kind = UDATA_DNS;
+		d->host = strdup(http.host);
+		d->port = strdup(http.port);
+		if (d->host == NULL || d->port == NULL)
+			return -1;
+		m->lookup = d;
+
+		d->start = now;
+		d->q = getaddrinfo_async(d->host, d->port, &hints, NULL);
+		if (d->q == NULL)
+			d->error = EAI_SYSTEM;
+		else
+			dns_step(d, kq, &now);
+	}
+	free(http.url);
+	free(http.path);
+	return 0;
+}
+
+/*
+ * -e: gives up on the lookups which have taken s, runs those asr(3)
+ * wants to be run again by now, and returns how long it is until the
+ * next of either is due, or -1 if there are none
+ */
+static double
+pipe_dns(struct pipe_st *p, int kq, struct timespec *now, double s)
+{
+	struct dns_st *d;
+	double wait = -1, left;
+	int c;
+
+	for (c = 0; c < p->dns_len; ++c) {
+		d = p->dns[c];
+		if (d->q == NULL)
+			continue;
+		if (ts_elapsed(&d->start, now) >= s) {
+			asr_abort(d->q);
+			d->q = NULL;
+			d->error = EAI_AGAIN;
+			continue;
+		}
+		if (ts_elapsed(&d->deadline, now) >= 0 &&
+		    dns_step(d, kq, now) == 0)
+			continue;
+
+		left = s - ts_elapsed(&d->start, now);
+		if (ts_elapsed(now, &d->deadline) < left)
+			left = ts_elapsed(now, &d->deadline);
+		if (left < 0)
+			left = 0;
+		if (wait == -1 || left < wait)
+			wait = left;
+	}
+	return wait;
+}
+
+/*
+ * -e: once the sweep is over, the lookups become the table sorted for
+ * dns_find() which later probes share. Returns NULL if out of memory.
+ */
+static struct dns_st *
+pipe_end(struct pipe_st *p, int *len)
+{
+	struct dns_st *d;
+	int c;
+
+	d = calloc(p->dns_len + 1, sizeof(struct dns_st));
+	if (d == NULL)
+		return NULL;
+	for (c = 0; c < p->dns_len; ++c) {
+		d[c] = *p->dns[c];
+		free(p->dns[c]);
+	}
+	for (c = 0; c < p->length; ++c)
+		p->array[c]->lookup = NULL;
+	qsort(d, p->dns_len, sizeof(struct dns_st), dns_cmp);
+	*len = p->dns_len;
+
+	free(p->dns);
+	intern_free(&p->urls);
+	intern_free(&p->labels);
+	intern_free(&p->hosts);
+	return d;
+}
+
+/* folds one result into a history record, total < 0 is a failure */
+static void
+hist_update(struct hist_st *h, double total, time_t now)
+{
+	if (h == NULL)
+		return;
+	h->seen = now;
+	if (total < 0) {
+		++h->fails;
+		return;
+	}
+	if (h->ok == 0)
+		h->ewma = total;
+	else
+		h->ewma = HIST_ALPHA * total + (1 - HIST_ALPHA) * h->ewma;
+	++h->ok;
+	h->fails = 0;
+}
+
+/*
+ * sends the history to the writer as a "history" message, leaving out
+ * the records which were never probed or have expired
+ */
+static void
+hist_send(FILE *to_write, struct hist_st *hist, int total, time_t now)
+{
+	char *hist_buf;
+	size_t hist_len;
+	FILE *hist_out;
+	int c;
+
+	hist_out = open_memstream(&hist_buf, &hist_len);
+	if (hist_out == NULL)
+		err(EXIT_FAILURE, "open_memstream line: %d", __LINE__);
+	for (c = 0; c < total; ++c) {
+		if (hist[c].ok == 0 && hist[c].fails == 0)
+			continue;
+		if (now - hist[c].seen > HIST_EXPIRE)
+			continue;
+		fprintf(hist_out, "%s %f %d %d %lld\n", hist[c].ftp_file,
+		    hist[c].ewma, hist[c].ok, hist[c].fails,
+		    (long long)hist[c].seen);
+	}
+	if (fclose(hist_out) == EOF)
+		err(EXIT_FAILURE, "fclose line: %d", __LINE__);
+
+	fprintf(to_write, "history %zu\n", hist_len);
+	fwrite(hist_buf, 1, hist_len, to_write);
+	fflush(to_write);
+	free(hist_buf);
+}
+
+static void
+aimd_init(struct aimd_st *a, int max, struct timespec *now)
+{
+	memset(a, 0, sizeof(struct aimd_st));
+	a->level = a->good = 1;
+	a->ceiling = max;
+	a->start = *now;
+}
+
+/*
+ * -j auto: a probe has ended with 'got' bytes, and took 'inflate' times
+ * its moving average, or -1 if that isn't known. Once a window of
+ * AIMD_WINDOW times a->level probes have ended, the level goes up by one,
+ * unless it is at the ceiling. If the last rise didn't pay off in bytes
+ * per second, or the probes have slowed each other down, it is halved
+ * instead and the ceiling is set below it. The window after that is only
+ * waited out.
+ */
+static void
+aimd_done(struct aimd_st *a, long long got, double inflate,
+    struct timespec *now)
+{
+	double rate, elapsed, mean = -1;
+	int level = a->level;
+
+	a->bytes += got;
+	if (inflate > 0) {
+		a->inflate += inflate;
+		++a->inflate_len;
+	}
+	if (++a->done < AIMD_WINDOW * a->level)
+		return;
+
+	elapsed = ts_elapsed(&a->start, now);
+	rate = (elapsed > 0) ? a->bytes / elapsed : 0;
+	if (a->inflate_len > 0)
+		mean = a->inflate / a->inflate_len;
+
+	if (a->drain) {
+		a->drain = 0;
+		a->rate_level = 0;
+	} else if ((a->rate_level > 0 && level > a->rate_level &&
+	    rate < a->rate * (1 + AIMD_GAIN * (level - a->rate_level) /
+	    a->rate_level)) || (mean != -1 && a->base > 0 &&
+	    mean > AIMD_INFLATE * a->base)) {
+		a->ceiling = (level > 1) ? level - 1 : 1;
+		if (a->good > a->ceiling)
+			a->good = a->ceiling;
+		a->level = (level + 1) / 2;
+		a->drain = 1;
+	} else {
+		if (a->good < level)
+			a->good = level;
+		if (level < a->ceiling)
+			++a->level;
+		if (mean != -1 && (a->base == 0 || mean < a->base))
+			a->base = mean;
+		a->rate = rate;
+		a->rate_level = level;
+	}
+
+	a->done = 0;
+	a->bytes = 0;
+	a->inflate = 0;
+	a->inflate_len = 0;
+	a->start = *now;
+}
+
+/*
+ * -d and -t: probes the n mirrors at once, 'tag' appended to each, and
+ * leaves what each took in its diff: s for a timeout, more for an error.
+ * With 'keep', a connection a mirror has kept alive is used and kept
+ * for the next. Returns -1 if it runs out of memory.
+ */
+static int
+probe_batch(struct mirror_st **m, int n, int kq, double s,
+    struct tls_config *tls_cfg, const char *tag, const char *range,
+    long long cap, struct dns_st *dns, int dns_len, int8_t keep)
+{
+	struct http_st *h;
+	struct event_st *kev;
+	struct timespec start, now, timeout;
+	char *url;
+	double wait;
+	int i, k, r, pending = 0;
+
+	h = calloc(n, sizeof(struct http_st));
+	kev = calloc(n, sizeof(struct event_st));
+	if (h == NULL || kev == NULL)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k = 0; k < n; ++k) {
+		h[k].fd = -1;
+		h[k].dns_cache = dns;
+		h[k].dns_cache_len = dns_len;
+		h[k].extra = range;
+		h[k].cap = (range != NULL) ? cap : 0;
+		h[k].keep = keep;
+		m[k]->diff = s + 1;
+		if (asprintf(&url, "%s%s", m[k]->ftp_file, tag) == -1)
+			return -1;
+		if (keep && m[k]->idle_fd != -1) {
+			r = http_reuse(&h[k], url, tls_cfg, m[k]->idle_fd,
+			    m[k]->idle_tls);
+			m[k]->idle_fd = -1;
+			m[k]->idle_tls = NULL;
+		} else
+			r = http_get(&h[k], url, tls_cfg);
+		free(url);
+		if (r == -1) {
+			http_close(&h[k]);
+			continue;
+		}
+		if (ev_add(kq, h[k].fd, EVENT_WRITE, &h[k]) == -1) {
+			http_close(&h[k]);
+			continue;
+		}
+		++pending;
+	}
+
+	while (pending > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = s - ts_elapsed(&start, &now);
+		if (wait <= 0)
+			break;
+		timeout.tv_sec = (time_t) wait;
+		timeout.tv_nsec = (long) ((wait - (double) timeout.tv_sec) *
+		    1000000000.0);
+
+		i = ev_wait(kq, kev, n, &timeout);
+		if (i == -1)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		while (--i >= 0) {
+			struct http_st *p = kev[i].udata;
+
+			k = p - h;
+			r = http_step(p);
+			if (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE) {
+				if (ev_add(kq, p->fd, (r == HTTP_WANT_READ) ?
+				    EVENT_READ : EVENT_WRITE, p) == 0)
+					continue;
+				p->state = HTTP_FAIL;
+			}
+			if (p->state == HTTP_DONE &&
+			    (p->status == 200 || p->status == 206)) {
+				m[k]->diff = ts_elapsed(&start, &now);
+
+				/* only as many as it was handed are kept */
+				if (p->reusable && p->reused &&
+				    p->redirects == 0) {
+					m[k]->idle_fd = p->fd;
+					m[k]->idle_tls = p->tls;
+					p->fd = -1;
+					p->tls = NULL;
+				}
+			}
+			http_close(p);
+			--pending;
+		}
+	}
+
+	/* closing the sockets drops their events */
+	for (k = 0; k < n; ++k) {
+		if (h[k].fd != -1) {
+			http_close(&h[k]);
+			m[k]->diff = s;
+		}
+		free(h[k].url);
+		free(h[k].path);
+		free(h[k].etag);
+		free(h[k].modified);
+	}
+	free(h);
+	free(kev);
+	return 0;
+}
+
+/* -t: the mirrors as fast as they were for one of the other targets */
+static int
+target_cmp(const void *a, const void *b)
+{
+	struct mirror_st **one = (struct mirror_st **) a;
+	struct mirror_st **two = (struct mirror_st **) b;
+
+	if ((*one)->diff < (*two)->diff)
+		return -1;
+	if ((*one)->diff > (*two)->diff)
+		return 1;
+	return 0;
+}
+
+/* -t: "snapshots" or a release like "7.6", a '/' and an architecture */
+static int
+target_ok(const char *t)
+{
+	const char *slash = strchr(t, '/');
+	const char *c;
+	int dots = 0;
+
+	if (slash == NULL || slash[1] == '\0' || strlen(slash + 1) > 32)
+		return 0;
+	if (strncmp(t, "snapshots/", 10)) {
+		if (slash - t > 4 || !isdigit((unsigned char)*t) ||
+		    !isdigit((unsigned char)slash[-1]))
+			return 0;
+		for (c = t; c < slash; ++c) {
+			if (*c == '.')
+				++dots;
+			else if (!isdigit((unsigned char)*c))
+				return 0;
+		}
+		if (dots != 1)
+			return 0;
+	}
+	for (c = slash + 1; *c != '\0'; ++c) {
+		if (!isalnum((unsigned char)*c))
+			return 0;
+	}
+	return 1;
+}
+
+#ifndef __OpenBSD__
+/* the OpenBSD architecture of what uname() calls 'machine', or NULL */
+static const char *
+host_arch(const char *machine)
+{
+	static const char *arch[][2] = {
+		{ "x86_64", "amd64" }, { "amd64", "amd64" },
+		{ "aarch64", "arm64" }, { "arm64", "arm64" },
+		{ "i386", "i386" }, { "i486", "i386" },
+		{ "i586", "i386" }, { "i686", "i386" },
+		{ "armv7l", "armv7" }, { "armv7", "armv7" },
+		{ "ppc64", "powerpc64" }, { "powerpc64", "powerpc64" },
+		{ "riscv64", "riscv64" }, { "sparc64", "sparc64" }
+	};
+	size_t c;
+
+	for (c = 0; c < sizeof(arch) / sizeof(arch[0]); ++c) {
+		if (!strcmp(machine, arch[c][0]))
+			return arch[c][1];
+	}
+	return NULL;
+}
+#endif
+
+/* -d: the mirrors which have been fastest lately and still answer first */
+static int
+daemon_cmp(const void *a, const void *b)
+{
+	struct hist_st *one = (*(struct mirror_st **) a)->hist;
+	struct hist_st *two = (*(struct mirror_st **) b)->hist;
+	int8_t good1 = (one->ok > 0 && one->fails == 0);
+	int8_t good2 = (two->ok > 0 && two->fails == 0);
+
+	if (good1 != good2)
+		return good2 - good1;
+	if (one->ewma < two->ewma)
+		return -1;
+	if (one->ewma > two->ewma)
+		return 1;
+	return 0;
+}
+
+/* -L: queues bytes for the client */
+static void
+proxy_append(struct proxy_st *p, const char *buf, size_t len)
+{
+	size_t max;
+	char *out;
+
+	if (p->out_off > 0 && len > p->out_max - p->out_len) {
+		memmove(p->out, p->out + p->out_off, p->out_len - p->out_off);
+		p->out_len -= p->out_off;
+		p->out_off = 0;
+	}
+	if (len > p->out_max - p->out_len) {
+		max = (p->out_max > 0) ? p->out_max : 16384;
+		while (len > max - p->out_len)
+			max *= 2;
+		out = realloc(p->out, max);
+		if (out == NULL)
+			err(EXIT_FAILURE, "realloc line: %d", __LINE__);
+		p->out = out;
+		p->out_max = max;
+	}
+	memcpy(p->out + p->out_len, buf, len);
+	p->out_len += len;
+}
+
+/* a moving average, so a mirror which slows down mid-upgrade loses out */
+static void
+proxy_live(struct mirror_st *m, double t)
+{
+	if (m->live == 0)
+		m->live = t;
+	else
+		m->live = HIST_ALPHA * t + (1 - HIST_ALPHA) * m->live;
+}
+
+/*
+ * the response header for the client. A body of unknown length is sent
+ * chunked, so that a relay cut short can't pass for a whole file.
+ */
+static void
+proxy_head(struct proxy_st *p, int status)
+{
+	struct timespec now;
+	char head[256];
+	const char *reason;
+	int n;
+
+	switch (status) {
+	case 200:
+		reason = "OK";
+		break;
+	case 400:
+		reason = "Bad Request";
+		break;
+	case 404:
+		reason = "Not Found";
+		break;
+	case 405:
+		reason = "Method Not Allowed";
+		break;
+	case 503:
+		reason = "Service Unavailable";
+		break;
+	default:
+		status = 502;
+		reason = "Bad Gateway";
+		break;
+	}
+
+	p->total = (status == 200) ? p->up.length : 0;
+	if (status == 200 && p->up.length == -1) {
+		p->chunked = 1;
+		n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+		    "Transfer-Encoding: chunked\r\n"
+		    "Connection: close\r\n\r\n");
+	} else {
+		n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n"
+		    "Content-Length: %lld\r\n"
+		    "Connection: close\r\n\r\n", status, reason,
+		    (status == 200) ? p->up.length : 0);
+	}
+	proxy_append(p, head, n);
+	p->head_sent = 1;
+	p->status = status;
+
+	/* -r answers without a mirror */
+	if (status == 200 && p->m != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		proxy_live(p->m, ts_elapsed(&p->dialed, &now));
+	}
+}
+
+/*
+ * whether the mirror's response is what the client is owed: the file,
+ * or once part of it is on its way, the rest of it
+ */
+static int
+proxy_ok(struct proxy_st *p)
+{
+	if (p->up.extra == NULL)
+		return p->up.status == 200;
+	return p->up.status == 206 && p->up.range_off == p->resume &&
+	    (p->total == -1 || p->up.range_total == p->total);
+}
+
+/* http_st.sink of a relay: only what proxy_ok() allows is passed on */
+static void
+proxy_sink(void *arg, const char *buf, size_t len)
+{
+	struct proxy_st *p = arg;
+	char size[32];
+	int n;
+
+	if (!proxy_ok(p) || len == 0)
+		return;
+	if (!p->head_sent)
+		proxy_head(p, 200);
+	if (p->chunked) {
+		n = snprintf(size, sizeof(size), "%zx\r\n", len);
+		proxy_append(p, size, n);
+	}
+	proxy_append(p, buf, len);
+	if (p->chunked)
+		proxy_append(p, "\r\n", 2);
+	p->sent += len;
+}
+
+/*
+ * reads the client's request. Returns -1 if the client is gone, 0 while
+ * the request is incomplete, otherwise the status to answer it with:
+ * 200 once p->path holds a path to fetch.
+ */
+static int
+proxy_read(struct proxy_st *p, int kq)
+{
+	char *path, *end, *c;
+	ssize_t r;
+
+	r = read(p->fd, p->req + p->req_len, sizeof(p->req) - 1 - p->req_len);
+	if (r == -1 && errno == EAGAIN)
+		r = -2;
+	else if (r <= 0)
+		return -1;
+	else {
+		p->req_len += r;
+		p->req[p->req_len] = '\0';
+		if (strstr(p->req, "\r\n\r\n") != NULL ||
+		    strstr(p->req, "\n\n") != NULL)
+			r = 0;
+		else if (p->req_len == sizeof(p->req) - 1)
+			return 400;
+	}
+	if (r != 0) {
+		return (ev_add(kq, p->fd, EVENT_READ, p) == -1) ? -1 : 0;
+	}
+
+	if (strncmp(p->req, "GET ", 4))
+		return 405;
+	path = p->req + 4;
+	end = strchr(path, ' ');
+	if (end == NULL || strncmp(end + 1, "HTTP/1.", 7))
+		return 400;
+	*end = '\0';
+
+	/* a path below the mirrors' directory, with nothing odd in it */
+	if (*path != '/' || strstr(path, "..") != NULL)
+		return 400;
+	for (c = path; *c != '\0'; ++c) {
+		if (*c <= ' ' || *c >= 0x7f)
+			return 400;
+	}
+	if ((p->path = strdup(path)) == NULL)
+		err(EXIT_FAILURE, "strdup line: %d", __LINE__);
+	return 200;
+}
+
+/*
+ * writes what it can to the client. Returns -1 once the client is gone
+ * or has been sent all there is for it.
+ */
+static int
+proxy_flush(struct proxy_st *p, int kq)
+{
+	ssize_t r;
+
+	while (p->out_off < p->out_len) {
+		r = write(p->fd, p->out + p->out_off, p->out_len - p->out_off);
+		if (r == -1 && errno == EAGAIN) {
+			if (ev_add(kq, p->fd, EVENT_WRITE, p) == -1)
+				return -1;
+			return 0;
+		}
+		if (r <= 0)
+			return -1;
+		p->out_off += r;
+		clock_gettime(CLOCK_MONOTONIC, &p->progress);
+	}
+	p->out_off = p->out_len = 0;
+
+	if (p->closing)
+		return -1;
+
+	/* the client has caught up with the mirror */
+	if (p->paused) {
+		p->paused = 0;
+		if (ev_add(kq, p->up.fd, EVENT_READ, p) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * ends the relay from p->m. A connection which is fit for another
+ * request is kept for the next one to that mirror.
+ */
+static void
+proxy_release(struct proxy_st *p)
+{
+	struct mirror_st *m = p->m;
+
+	if (!p->busy)
+		return;
+	p->busy = p->paused = 0;
+	--m->active;
+	if (p->up.state == HTTP_DONE && p->up.reusable &&
+	    p->up.redirects == 0 && m->idle_fd == -1) {
+		m->idle_fd = p->up.fd;
+		m->idle_tls = p->up.tls;
+		p->up.fd = -1;
+		p->up.tls = NULL;
+	}
+	http_close(&p->up);
+}
+
+/*
+ * sends p->path to the mirror of 'top' with the fewest requests in
+ * flight, so that many at once get the bandwidth of all of them, or of
+ * those, the one which has been quickest to answer lately. Mirrors
+ * already tried for it are skipped. If the client has part of the file,
+ * only the rest is asked for. Returns -1 if none is left.
+ */
+static int
+proxy_dial(struct proxy_st *p, struct mirror_st **top, int ntop, int kq,
+    double s, struct tls_config *tls_cfg)
+{
+	struct mirror_st *m;
+	char *url;
+	double lat, best;
+	int c, pick, r;
+
+	for (;;) {
+		pick = -1;
+		best = 0;
+		for (c = 0; c < ntop; ++c) {
+			if (p->tried & (1 << c))
+				continue;
+			lat = (top[c]->live > 0) ? top[c]->live : top[c]->diff;
+			if (pick == -1 || top[c]->active < top[pick]->active ||
+			    (top[c]->active == top[pick]->active &&
+			    lat < best)) {
+				pick = c;
+				best = lat;
+			}
+		}
+		if (pick == -1)
+			return -1;
+		p->tried |= 1 << pick;
+		m = top[pick];
+
+		if (p->head_sent) {
+			p->resume = p->sent;
+			snprintf(p->range, sizeof(p->range),
+			    "Range: bytes=%lld-\r\n", p->resume);
+			p->up.extra = p->range;
+		} else
+			p->up.extra = NULL;
+
+		if (asprintf(&url, "%s%s", m->ftp_file, p->path) == -1)
+			err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+		if (m->idle_fd != -1) {
+			r = http_reuse(&p->up, url, tls_cfg, m->idle_fd,
+			    m->idle_tls);
+			m->idle_fd = -1;
+			m->idle_tls = NULL;
+		} else
+			r = http_get(&p->up, url, tls_cfg);
+		free(url);
+		if (r == 0) {
+			r = ev_add(kq, p->up.fd, EVENT_WRITE, p);
+		}
+		if (r == -1) {
+			http_close(&p->up);
+			proxy_live(m, s);
+			continue;
+		}
+
+		++m->active;
+		p->m = m;
+		p->busy = 1;
+		clock_gettime(CLOCK_MONOTONIC, &p->dialed);
+		p->progress = p->dialed;
+		return 0;
+	}
+}
+
+/*
+ * the relay failed, so the request moves on to the next mirror. Once
+ * every one has failed, the client gets a 404 if any mirror answered
+ * so, a 502 otherwise, or if it had part of the file, what is left of
+ * it in its buffer before the connection is closed.
+ */
+static int
+proxy_retry(struct proxy_st *p, struct mirror_st **top, int ntop, int kq,
+    double s, struct tls_config *tls_cfg)
+{
+	if (p->busy) {
+		if (p->up.status != 0 && p->status != 404)
+			p->status = p->up.status;
+		proxy_live(p->m, s);
+		proxy_release(p);
+	}
+	if (proxy_dial(p, top, ntop, kq, s, tls_cfg) == 0)
+		return 0;
+	if (!p->head_sent)
+		proxy_head(p, (p->status == 404) ? 404 : 502);
+	p->closing = 1;
+	return proxy_flush(p, kq);
+}
+
+static void
+proxy_close(struct proxy_st *p)
+{
+	if (p->busy) {
+		p->up.state = HTTP_FAIL;
+		proxy_release(p);
+	}
+	close(p->fd);
+	p->fd = -1;
+	free(p->path);
+	p->path = NULL;
+	free(p->out);
+	p->out = NULL;
+	p->out_len = p->out_off = p->out_max = 0;
+	p->req_len = 0;
+	p->tried = p->status = 0;
+	p->sent = p->total = p->resume = 0;
+	p->head_sent = p->chunked = p->paused = p->closing = 0;
+}
+
+/*
+ * -L: relays the requests of clients on loopback to the PROXY_TOP
+ * fastest mirrors, spread by their latency as it is seen and how busy
+ * each is. A mirror which fails or stalls for s is passed over for the
+ * next, which is only asked for the rest of the file if part of it is
+ * on its way. It only returns if the event queue fails.
+ */
+static void
+proxy_run(int lfd, struct mirror_st **array, int length, int kq, double s,
+    struct tls_config *tls_cfg, int8_t verbose)
+{
+	struct mirror_st *top[PROXY_TOP];
+	struct proxy_st *px, *p;
+	struct dns_st *dns;
+	struct event_st *kev;
+	struct timespec now, timeout;
+	double wait, limit;
+	int c, fd, i, k, r, ntop, dns_len;
+
+	/* a client or a mirror hanging up must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (ntop = 0; ntop < length && ntop < PROXY_TOP &&
+	    array[ntop]->diff < s; ++ntop) {
+		top[ntop] = array[ntop];
+		top[ntop]->idle_fd = -1;
+		top[ntop]->idle_tls = NULL;
+		top[ntop]->active = 0;
+		top[ntop]->live = 0;
+	}
+
+	/* looked up once: a slow name server shouldn't stall a relay */
+	dns = dns_prefetch(top, ntop, &dns_len, kq, s);
+	px = calloc(PROXY_MAX, sizeof(struct proxy_st));
+	kev = calloc(PROXY_MAX + 1, sizeof(struct event_st));
+	if (dns == NULL || px == NULL || kev == NULL)
+		err(EXIT_FAILURE, "calloc line: %d", __LINE__);
+	for (k = 0; k < PROXY_MAX; ++k) {
+		px[k].fd = -1;
+		px[k].up.fd = -1;
+		px[k].up.keep = 1;
+		px[k].up.sink = proxy_sink;
+		px[k].up.sink_arg = &px[k];
+		px[k].up.dns_cache = dns;
+		px[k].up.dns_cache_len = dns_len;
+	}
+
+	if (ev_add(kq, lfd, EVENT_ACCEPT, NULL) == -1)
+		return;
+
+	if (verbose >= 1) {
+		printf("\nrelaying to:\n");
+		for (c = 0; c < ntop; ++c)
+			printf("%s\n", top[c]->ftp_file);
+		fflush(stdout);
+	}
+
+	for (;;) {
+		/* the soonest a client or a relay is due to stall */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = PROXY_IDLE;
+		for (k = 0; k < PROXY_MAX; ++k) {
+			p = &px[k];
+			if (p->fd == -1)
+				continue;
+			limit = (p->busy && !p->paused) ? s : PROXY_IDLE;
+			limit -= ts_elapsed(&p->progress, &now);
+			if (limit < wait)
+				wait = limit;
+		}
+		if (wait < 0)
+			wait = 0;
+		timeout.tv_sec = (time_t) wait;
+		timeout.tv_nsec = (long) ((wait - (double) timeout.tv_sec) *
+		    1000000000.0);
+
+		i = ev_wait(kq, kev, PROXY_MAX + 1, &timeout);
+		if (i == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		while (--i >= 0) {
+			p = kev[i].udata;
+
+			if (p == NULL) {
+				while ((fd = accept4(lfd, NULL, NULL,
+				    SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+					for (k = 0; k < PROXY_MAX &&
+					    px[k].fd != -1; ++k)
+						;
+					if (k == PROXY_MAX) {
+						close(fd);
+						continue;
+					}
+					px[k].fd = fd;
+					px[k].progress = now;
+					if (ev_add(kq, fd, EVENT_READ,
+					    &px[k]) == -1)
+						proxy_close(&px[k]);
+				}
+				continue;
+			}
+			if (p->fd == -1)
+				continue;
+
+			/* the client */
+			if (kev[i].ident == (uintptr_t)p->fd) {
+				p->progress = now;
+				if (kev[i].filter == EVENT_WRITE)
+					r = proxy_flush(p, kq);
+				else if (p->path != NULL)
+					r = 0;
+				else {
+					r = proxy_read(p, kq);
+					if (r == 200)
+						r = proxy_retry(p, top, ntop,
+						    kq, s, tls_cfg);
+					else if (r > 0) {
+						proxy_head(p, r);
+						p->closing = 1;
+						r = proxy_flush(p, kq);
+					}
+				}
+				if (r == -1)
+					proxy_close(p);
+				continue;
+			}
+			if (!p->busy || kev[i].ident != (uintptr_t)p->up.fd)
+				continue;
+
+			/* its mirror */
+			p->progress = now;
+			r = http_step(&p->up);
+			if (r == HTTP_WANT_READ &&
+			    p->out_len - p->out_off >= PROXY_BUF)
+				p->paused = 1;
+			else if (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE) {
+				if (ev_add(kq, p->up.fd, (r == HTTP_WANT_READ) ?
+				    EVENT_READ : EVENT_WRITE, p) == -1)
+					p->up.state = HTTP_FAIL;
+			}
+
+			if (p->up.state == HTTP_FAIL ||
+			    (p->up.state == HTTP_DONE && !proxy_ok(p))) {
+				if (verbose >= 2) {
+					printf("failed %d: %s%s\n",
+					    p->up.status, p->m->ftp_file,
+					    p->path);
+				}
+				if (proxy_retry(p, top, ntop, kq, s,
+				    tls_cfg) == -1)
+					proxy_close(p);
+				continue;
+			} else if (p->up.state == HTTP_DONE) {
+				if (!p->head_sent)
+					proxy_head(p, 200);
+				if (p->chunked)
+					proxy_append(p, "0\r\n\r\n", 5);
+				if (verbose >= 1) {
+					printf("%f %s%s\n",
+					    ts_elapsed(&p->dialed, &now),
+					    p->m->ftp_file, p->path);
+				}
+				proxy_release(p);
+				p->closing = 1;
+			}
+			if (proxy_flush(p, kq) == -1)
+				proxy_close(p);
+		}
+
+		/* stalls */
+		for (k = 0; k < PROXY_MAX; ++k) {
+			p = &px[k];
+			if (p->fd == -1)
+				continue;
+			limit = (p->busy && !p->paused) ? s : PROXY_IDLE;
+			if (ts_elapsed(&p->progress, &now) < limit)
+				continue;
+			if (p->busy && !p->paused) {
+				if (verbose >= 2) {
+					printf("stalled: %s%s\n",
+					    p->m->ftp_file, p->path);
+				}
+				if (proxy_retry(p, top, ntop, kq, s,
+				    tls_cfg) == 0)
+					continue;
+			}
+			proxy_close(p);
+		}
+		fflush(stdout);
+	}
+}
+
+/* http_st.sink which keeps the body in a memstream */
+static void
+fetch_keep(void *arg, const char *buf, size_t len)
+{
+	fwrite(buf, 1, len, arg);
+}
+
+/*
+ * -g: looks 'name' up in the SHA256 file at 'sums' of the fastest
+ * mirrors, trying the next if one fails. 'hex' receives its digest.
+ */
+static int
+fetch_sum(struct mirror_st **array, int length, int kq, double s,
+    struct tls_config *tls_cfg, const char *sums, const char *name,
+    char hex[SHA256_DIGEST_STRING_LENGTH])
+{
+	struct http_st h;
+	struct event_st ev;
+	struct timespec timeout;
+	FILE *mem;
+	char *buf, *url, *line, *want;
+	size_t len;
+	int c, r;
+
+	if (asprintf(&want, "SHA256 (%s) = ", name) == -1)
+		return -1;
+	timeout.tv_sec = (time_t) s;
+	timeout.tv_nsec = (long) ((s - (double) timeout.tv_sec) * 1000000000.0);
+
+	for (c = 0; c < length && c < FETCH_TOP && array[c]->diff < s; ++c) {
+		memset(&h, 0, sizeof(h));
+		h.fd = -1;
+		mem = open_memstream(&buf, &len);
+		if (mem == NULL)
+			return -1;
+		h.sink = fetch_keep;
+		h.sink_arg = mem;
+
+		if (asprintf(&url, "%s%s", array[c]->ftp_file, sums) == -1)
+			return -1;
+		r = (http_get(&h, url, tls_cfg) == -1) ? 0 : HTTP_WANT_WRITE;
+		free(url);
+
+		/* s is how long it may stall */
+		while (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE) {
+			if (ev_add(kq, h.fd, (r == HTTP_WANT_READ) ?
+			    EVENT_READ : EVENT_WRITE, NULL) == -1 ||
+			    ev_wait(kq, &ev, 1, &timeout) <= 0) {
+				h.state = HTTP_FAIL;
+				break;
+			}
+			r = http_step(&h);
+		}
+		http_close(&h);
+		free(h.url);
+		free(h.path);
+		free(h.etag);
+		free(h.modified);
+		if (fclose(mem) == EOF)
+			return -1;
+
+		r = -1;
+		if (h.state == HTTP_DONE && h.status == 200) {
+			for (line = strtok(buf, "\n"); line != NULL;
+			    line = strtok(NULL, "\n")) {
+				if (strncmp(line, want, strlen(want)))
+					continue;
+				line += strlen(want);
+				line[strcspn(line, "\r")] = '\0';
+				if (strlen(line) !=
+				    SHA256_DIGEST_STRING_LENGTH - 1)
+					break;
+				strlcpy(hex, line, SHA256_DIGEST_STRING_LENGTH);
+				r = 0;
+				break;
+			}
+		}
+		free(buf);
+		if (r == 0) {
+			free(want);
+			return 0;
+		}
+	}
+	free(want);
+	return -1;
+}
+
+/* whether the response is the range that was asked for */
+static int
+fetch_ok(struct fetch_st *f)
+{
+	if (f->http.status == 206)
+		return f->http.range_off == f->off;
+	return f->http.status == 200 && f->off == 0;
+}
+
+/* http_st.sink of -g: the range goes where it belongs in the file */
+static void
+fetch_sink(void *arg, const char *buf, size_t len)
+{
+	struct fetch_st *f = arg;
+	long long pos = f->off + f->written;
+	ssize_t r;
+
+	if (!fetch_ok(f))
+		return;
+
+	/* a range cut short by another mirror taking the rest */
+	if ((long long)len > f->end - pos)
+		len = f->end - pos;
+	while (len > 0) {
+		r = pwrite(f->fd, buf, len, pos);
+		if (r == -1)
+			err(EXIT_FAILURE, "pwrite line: %d", __LINE__);
+		buf += r;
+		len -= r;
+		pos += r;
+		f->written += r;
+		f->bytes += r;
+	}
+}
+
+/*
+ * asks f's mirror for [f->off, f->end) of 'path', over the connection
+ * its last range came over if it is still good
+ */
+static int
+fetch_dial(struct fetch_st *f, const char *path, int kq,
+    struct tls_config *tls_cfg)
+{
+	struct tls *tls;
+	char *url;
+	int fd, r;
+
+	snprintf(f->range, sizeof(f->range), "Range: bytes=%lld-%lld\r\n",
+	    f->off, f->end - 1);
+	f->http.extra = f->range;
+	f->http.cap = 0;
+	f->written = 0;
+
+	if (asprintf(&url, "%s%s", f->m->ftp_file, path) == -1)
+		return -1;
+	if (f->http.state == HTTP_DONE && f->http.reusable &&
+	    f->http.redirects == 0) {
+		fd = f->http.fd;
+		tls = f->http.tls;
+		f->http.fd = -1;
+		f->http.tls = NULL;
+		r = http_reuse(&f->http, url, tls_cfg, fd, tls);
+	} else
+		r = http_get(&f->http, url, tls_cfg);
+	free(url);
+	if (r == -1)
+		return -1;
+
+	if (ev_add(kq, f->http.fd, EVENT_WRITE, f) == -1)
+		return -1;
+	f->busy = 1;
+	clock_gettime(CLOCK_MONOTONIC, &f->progress);
+	return 0;
+}
+
+/* -g: puts a range back to be fetched by another mirror */
+static void
+fetch_back(struct seg_st **back, int *len, int *max, long long off,
+    long long end)
+{
+	struct seg_st *tmp;
+
+	if (*len == *max) {
+		*max = (*max > 0) ? *max * 2 : 8;
+		tmp = reallocarray(*back, *max, sizeof(struct seg_st));
+		if (tmp == NULL)
+			err(EXIT_FAILURE, "reallocarray line: %d", __LINE__);
+		*back = tmp;
+	}
+	(*back)[*len].off = off;
+	(*back)[(*len)++].end = end;
+}
+
+/*
+ * -g: fetches 'path' into 'fd' from the fastest mirrors at once. Each
+ * asks for the next FETCH_SEG bytes as it finishes a range, so a fast
+ * mirror fetches more of it. A mirror which fails or stalls for s is
+ * dropped and what it had left goes to the others. Returns the size of
+ * the file or -1.
+ */
+static long long
+fetch_run(struct mirror_st **array, int length, int kq, double s,
+    struct tls_config *tls_cfg, const char *path, int fd, int8_t verbose)
+{
+	struct fetch_st f[FETCH_TOP], *p, *v;
+	struct seg_st *back = NULL;
+	struct event_st kev[FETCH_TOP];
+	struct timespec now, timeout;
+	long long size = -1, next = 0, done = 0, left, most;
+	double wait;
+	int c, i, k, n, r, busy, back_len = 0, back_max = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(f, 0, sizeof(f));
+	for (n = 0; n < length && n < FETCH_TOP && array[n]->diff < s; ++n) {
+		f[n].m = array[n];
+		f[n].fd = fd;
+		f[n].http.fd = -1;
+		f[n].http.keep = 1;
+		f[n].http.sink = fetch_sink;
+		f[n].http.sink_arg = &f[n];
+	}
+
+	/* the first range tells how big the file is */
+	for (k = 0; k < n; ++k) {
+		f[k].off = 0;
+		f[k].end = FETCH_SEG;
+		if (fetch_dial(&f[k], path, kq, tls_cfg) == 0)
+			break;
+		http_close(&f[k].http);
+		f[k].busy = 0;
+		f[k].dead = 1;
+	}
+	if (k == n)
+		return -1;
+	next = FETCH_SEG;
+
+	while (size == -1 || done < size) {
+		busy = 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = s;
+		for (k = 0; k < n; ++k) {
+			if (!f[k].busy)
+				continue;
+			++busy;
+			if (s - ts_elapsed(&f[k].progress, &now) < wait)
+				wait = s - ts_elapsed(&f[k].progress, &now);
+		}
+		if (busy == 0)
+			break;
+		if (wait < 0)
+			wait = 0;
+		timeout.tv_sec = (time_t) wait;
+		timeout.tv_nsec = (long) ((wait - (double) timeout.tv_sec) *
+		    1000000000.0);
+
+		i = ev_wait(kq, kev, FETCH_TOP, &timeout);
+		if (i == -1)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		while (--i >= 0) {
+			p = kev[i].udata;
+			if (!p->busy)
+				continue;
+			p->progress = now;
+			r = http_step(&p->http);
+			if (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE) {
+				if (ev_add(kq, p->http.fd,
+				    (r == HTTP_WANT_READ) ? EVENT_READ :
+				    EVENT_WRITE, p) == -1)
+					p->http.state = HTTP_FAIL;
+			}
+
+			/* a mirror which ignores Range is no use to share */
+			if ((p->http.state == HTTP_BODY ||
+			    p->http.state == HTTP_DONE) && !fetch_ok(p))
+				p->http.state = HTTP_FAIL;
+			if (size == -1 && p->http.state == HTTP_BODY &&
+			    p->http.status == 200) {
+				size = (p->http.length != -1) ?
+				    p->http.length : LLONG_MAX;
+				p->end = next = size;
+			} else if (size == -1 && (p->http.state == HTTP_BODY ||
+			    p->http.state == HTTP_DONE) &&
+			    p->http.range_total != -1) {
+				size = p->http.range_total;
+				if (p->end > size)
+					p->end = size;
+				if (next > size)
+					next = size;
+			}
+
+			if (p->http.state == HTTP_DONE &&
+			    p->off + p->written >= p->end) {
+				p->busy = 0;
+				done += p->end - p->off;
+			} else if (p->http.state == HTTP_DONE && size ==
+			    LLONG_MAX) {
+				/* the whole file, of unknown length */
+				p->busy = 0;
+				done = size = p->written;
+			} else if (p->http.state == HTTP_DONE ||
+			    p->http.state == HTTP_FAIL)
+				p->dead = 1;
+		}
+
+		/* stalls */
+		for (k = 0; k < n; ++k) {
+			if (f[k].busy &&
+			    ts_elapsed(&f[k].progress, &now) >= s)
+				f[k].dead = 1;
+		}
+
+		for (k = 0; k < n; ++k) {
+			p = &f[k];
+			if (!p->dead || !p->busy)
+				continue;
+
+			/* the rest of its range goes back in the pool */
+			if (verbose >= 2)
+				printf("dropped: %s\n", p->m->ftp_file);
+			p->busy = 0;
+			http_close(&p->http);
+			done += p->written;
+			fetch_back(&back, &back_len, &back_max,
+			    p->off + p->written, p->end);
+		}
+		if (size == LLONG_MAX)
+			continue;
+
+		/* every idle mirror gets a range */
+		for (k = 0; k < n; ++k) {
+			p = &f[k];
+			if (p->busy || p->dead)
+				continue;
+			if (back_len > 0) {
+				p->off = back[--back_len].off;
+				p->end = back[back_len].end;
+			} else if (size == -1)
+				continue;
+			else if (next < size) {
+				p->off = next;
+				p->end = (size - next > FETCH_SEG) ?
+				    next + FETCH_SEG : size;
+				next = p->end;
+			} else {
+				/* half of what a slower mirror has left */
+				v = NULL;
+				most = 2 * FETCH_STEAL - 1;
+				for (c = 0; c < n; ++c) {
+					left = f[c].end - f[c].off -
+					    f[c].written;
+					if (f[c].busy && left > most) {
+						v = &f[c];
+						most = left;
+					}
+				}
+				if (v == NULL)
+					continue;
+				p->end = v->end;
+				p->off = v->end = v->end - most / 2;
+				v->http.cap = v->end - v->off;
+				if (verbose >= 2) {
+					printf("%s takes %lld bytes from %s\n",
+					    p->m->ftp_file, p->end - p->off,
+					    v->m->ftp_file);
+				}
+			}
+			if (fetch_dial(p, path, kq, tls_cfg) == -1) {
+				http_close(&p->http);
+				p->busy = 0;
+				p->dead = 1;
+				fetch_back(&back, &back_len, &back_max, p->off,
+				    p->end);
+
+				/* for a mirror looked at already to take */
+				k = -1;
+			}
+		}
+	}
+
+	if (verbose >= 1 && size != -1 && done >= size) {
+		for (k = 0; k < n; ++k) {
+			printf("%5.1f%% %s%s\n", (size > 0) ?
+			    100.0 * f[k].bytes / size : 0, f[k].m->ftp_file,
+			    (f[k].dead) ? " (dropped)" : "");
+		}
+	}
+	for (k = 0; k < n; ++k) {
+		http_close(&f[k].http);
+		free(f[k].http.url);
+		free(f[k].http.path);
+		free(f[k].http.etag);
+		free(f[k].http.modified);
+	}
+	free(back);
+	return (size != -1 && done >= size) ? size : -1;
+}
+
+/* -g: the SHA256 of what fetch_run() wrote to fd */
+static int
+fetch_hash(int fd, long long size, char hex[SHA256_DIGEST_STRING_LENGTH])
+{
+	SHA2_CTX ctx;
+	unsigned char buf[65536];
+	long long pos;
+	ssize_t r;
+
+	SHA256Init(&ctx);
+	for (pos = 0; pos < size; pos += r) {
+		r = pread(fd, buf, sizeof(buf), pos);
+		if (r <= 0)
+			return -1;
+		SHA256Update(&ctx, buf, r);
+	}
+	SHA256End(&ctx, hex);
+	return 0;
+}
+
+/* -L and -r: a listening socket on 'addr', or -1 */
+static int
+listen_on(in_addr_t addr, int port, int backlog)
+{
+	struct sockaddr_in sin;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(addr);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(fd, backlog) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * -r: the ranking of 'target' as it is served, 'first' if it answered
+ * and then the other mirrors which answered, in the order of 'array'.
+ * 'when' is when they were probed.
+ */
+static void
+rank_doc(char **buf, size_t *len, const char *target,
+    struct mirror_st **array, int length, struct mirror_st *first,
+    double s, time_t when)
+{
+	FILE *fp;
+	int c;
+
+	free(*buf);
+	fp = open_memstream(buf, len);
+	if (fp == NULL)
+		err(EXIT_FAILURE, "open_memstream line: %d", __LINE__);
+	fprintf(fp, "pkg_ping ranking\ntarget %s\ntime %lld\n", target,
+	    (long long)when);
+	if (first->diff < s) {
+		fprintf(fp, "%f %s %s\n", first->diff, first->ftp_file,
+		    first->label);
+	}
+	for (c = 0; c < length; ++c) {
+		if (array[c] != first && array[c]->diff < s) {
+			fprintf(fp, "%f %s %s\n", array[c]->diff,
+			    array[c]->ftp_file, array[c]->label);
+		}
+	}
+	if (fclose(fp) == EOF)
+		err(EXIT_FAILURE, "fclose line: %d", __LINE__);
+}
+
+/*
+ * -r: answers the hosts asking for the ranking of one of the targets,
+ * "GET /7.6/amd64", for 'wait' seconds, or for good if it is -1. The
+ * event queue is left as it was found for the probes. Returns -1 if it
+ * fails.
+ */
 static int
-diff_cmp(const void *a, const void *b)
+rank_serve(int lfd, int kq, double wait, char **buf, size_t *len,
+    const char **target, int targets)
 {
-	struct mirror_st **one = (struct mirror_st **) a;
-	struct mirror_st **two = (struct mirror_st **) b;
+	struct proxy_st *px, *p;
+	struct event_st kev[RANK_MAX + 1];
+	struct timespec start, now, timeout;
+	double left;
+	int c, fd, i, k, r;
 
-	if ((*one)->diff < (*two)->diff)
+	signal(SIGPIPE, SIG_IGN);
+
+	px = calloc(RANK_MAX, sizeof(struct proxy_st));
+	if (px == NULL)
 		return -1;
-	if ((*one)->diff > (*two)->diff)
-		return 1;
-	return 0;
+	for (k = 0; k < RANK_MAX; ++k)
+		px[k].fd = -1;
+
+	if (ev_add(kq, lfd, EVENT_ACCEPT, NULL) == -1) {
+		free(px);
+		return -1;
+	}
+
+	r = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = RANK_IDLE;
+		if (wait >= 0) {
+			left = wait - ts_elapsed(&start, &now);
+			if (left <= 0)
+				break;
+			if (left > RANK_IDLE)
+				left = RANK_IDLE;
+		}
+		timeout.tv_sec = (time_t) left;
+		timeout.tv_nsec = (long) ((left - (double) timeout.tv_sec) *
+		    1000000000.0);
+
+		i = ev_wait(kq, kev, RANK_MAX + 1, &timeout);
+		if (i == -1) {
+			if (errno == EINTR)
+				continue;
+			r = -1;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		while (--i >= 0) {
+			p = kev[i].udata;
+
+			if (p == NULL) {
+				while ((fd = accept4(lfd, NULL, NULL,
+				    SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+					for (k = 0; k < RANK_MAX &&
+					    px[k].fd != -1; ++k)
+						;
+					if (k == RANK_MAX) {
+						close(fd);
+						continue;
+					}
+					px[k].fd = fd;
+					px[k].progress = now;
+					if (ev_add(kq, fd, EVENT_READ,
+					    &px[k]) == -1)
+						proxy_close(&px[k]);
+				}
+				continue;
+			}
+			if (p->fd == -1)
+				continue;
+
+			p->progress = now;
+			if (kev[i].filter == EVENT_WRITE)
+				k = proxy_flush(p, kq);
+			else {
+				k = proxy_read(p, kq);
+				c = targets;
+				if (k == 200) {
+					for (c = 0; c < targets &&
+					    (buf[c] == NULL ||
+					    strcmp(p->path + 1, target[c]));
+					    ++c)
+						;
+					if (c == targets)
+						k = 404;
+				}
+				if (k > 0) {
+					p->up.length = (k == 200) ? len[c] : 0;
+					proxy_head(p, k);
+					if (k == 200)
+						proxy_append(p, buf[c], len[c]);
+					p->closing = 1;
+					k = proxy_flush(p, kq);
+				}
+			}
+			if (k == -1)
+				proxy_close(p);
+		}
+
+		for (k = 0; k < RANK_MAX; ++k) {
+			if (px[k].fd != -1 &&
+			    ts_elapsed(&px[k].progress, &now) >= RANK_IDLE)
+				proxy_close(&px[k]);
+		}
+	}
+
+	/* the probes mustn't see these events */
+	for (k = 0; k < RANK_MAX; ++k) {
+		if (px[k].fd != -1)
+			proxy_close(&px[k]);
+	}
+	free(px);
+	if (ev_del(kq, lfd) == -1)
+		r = -1;
+	return r;
 }
 
-static int
-ftp_cmp(const void *a, const void *b)
+/*
+ * -R: fetches the ranking of 'target' which -r serves at 'url'. Returns
+ * its body, or NULL if it couldn't be fetched, stalling for up to s.
+ */
+static char *
+rank_get(const char *url, const char *target, int kq, double s,
+    struct tls_config *tls_cfg)
 {
-	struct mirror_st **one = (struct mirror_st **) a;
-	struct mirror_st **two = (struct mirror_st **) b;
+	struct http_st h;
+	struct event_st ev;
+	struct timespec timeout;
+	FILE *mem;
+	char *buf, *get;
+	size_t len;
+	int r;
+
+	timeout.tv_sec = (time_t) s;
+	timeout.tv_nsec = (long) ((s - (double) timeout.tv_sec) * 1000000000.0);
+
+	memset(&h, 0, sizeof(h));
+	h.fd = -1;
+	mem = open_memstream(&buf, &len);
+	if (mem == NULL)
+		err(EXIT_FAILURE, "open_memstream line: %d", __LINE__);
+	h.sink = fetch_keep;
+	h.sink_arg = mem;
 
-	return strcmp((*one)->ftp_file, (*two)->ftp_file);
+	if (asprintf(&get, "%s/%s", url, target) == -1)
+		err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+	r = (http_get(&h, get, tls_cfg) == -1) ? 0 : HTTP_WANT_WRITE;
+	free(get);
+
+	while (r == HTTP_WANT_READ || r == HTTP_WANT_WRITE) {
+		if (ev_add(kq, h.fd, (r == HTTP_WANT_READ) ? EVENT_READ :
+		    EVENT_WRITE, NULL) == -1 ||
+		    ev_wait(kq, &ev, 1, &timeout) <= 0) {
+			h.state = HTTP_FAIL;
+			break;
+		}
+		r = http_step(&h);
+	}
+	http_close(&h);
+	free(h.url);
+	free(h.path);
+	free(h.etag);
+	free(h.modified);
+	if (fclose(mem) == EOF)
+		err(EXIT_FAILURE, "fclose line: %d", __LINE__);
+
+	if (h.state != HTTP_DONE || h.status != 200) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
 }
 
+/*
+ * -R: checks that 'doc' is a ranking of 'target' which isn't stale,
+ * and points 'line' at each of its mirrors which -S and -u allow, the
+ * fastest first. Returns how many, or -1 if it won't do, which it
+ * won't if any of its URLs isn't fit for /etc/installurl.
+ */
 static int
-label_cmp(const void *a, const void *b)
+rank_parse(char *doc, const char *target, int8_t u, int8_t insecure,
+    char **line, int max, time_t *when)
 {
-	struct mirror_st **one = (struct mirror_st **) a;
-	struct mirror_st **two = (struct mirror_st **) b;
+	const char *head = "pkg_ping ranking\ntarget ";
+	char *p, *next, *url, *label, *c;
+	long long t;
+	int n = 0;
 
-	/* list the USA mirrors first, it will subsort correctly */
-	int8_t temp = !strncmp("USA", (*one)->label, 3);
-	if (temp != !strncmp("USA", (*two)->label, 3)) {
-		if (temp)
+	if (strncmp(doc, head, strlen(head)))
+		return -1;
+	p = doc + strlen(head);
+	if (strncmp(p, target, strlen(target)) ||
+	    strncmp(p + strlen(target), "\ntime ", 6))
+		return -1;
+	p += strlen(target) + 6;
+	t = strtoll(p, &next, 10);
+	if (next == p || *next != '\n')
+		return -1;
+	*when = (time_t)t;
+	if (time(NULL) - *when > RANK_STALE)
+		return -1;
+
+	for (p = next + 1; *p != '\0' && n < max; p = next) {
+		next = strchr(p, '\n');
+		if (next == NULL)
+			break;
+		*next++ = '\0';
+
+		/* "diff URL label" */
+		url = strchr(p, ' ');
+		if (url == NULL)
 			return -1;
-		return 1;
+		label = strchr(++url, ' ');
+
+		/* an http or https URL, with nothing odd in it */
+		if (strncmp(url, "http://", 7) && strncmp(url, "https://", 8))
+			return -1;
+		for (c = url; c != label && *c != '\0'; ++c) {
+			if (*c <= ' ' || *c >= 0x7f || c - url >= RANK_URL)
+				return -1;
+		}
+		label = (label != NULL) ? label + 1 : "";
+
+		if (u && !strncmp("USA", label, 3))
+			continue;
+		if (!insecure) {
+			if (strncmp(url, "https://", 8))
+				continue;
+		} else if (!strncmp(url, "https", 5))
+			continue;
+		line[n++] = p;
 	}
-	return strcmp((*one)->label, (*two)->label);
+	return n;
 }
 
+/*
+ * the write_pid side of a "name length" message: copies 'len' bytes
+ * from 'in' to 'tmp' and renames it over 'path', so a reader never
+ * sees half a file. The bytes are consumed even if that fails, and
+ * 'tmp' is removed unless it has replaced 'path'.
+ */
 static int
-label_rev_cmp(const void *a, const void *b)
+write_file(FILE *in, size_t len, const char *tmp, const char *path)
 {
-	struct mirror_st **one = (struct mirror_st **) a;
-	struct mirror_st **two = (struct mirror_st **) b;
+	char buf[4096];
+	size_t n;
+	FILE *out;
+	int8_t error = 0;
 
-	/* list the USA mirrors first, and will reverse subsort */
-	int8_t temp = !strncmp("USA", (*one)->label, 3);
-	if (temp != !strncmp("USA", (*two)->label, 3)) {
-		if (temp)
-			return -1;
-		return 1;
+	out = fopen(tmp, "w");
+	if (out == NULL)
+		error = 1;
+
+	while (len > 0) {
+		n = fread(buf, 1, (len < sizeof(buf)) ? len : sizeof(buf), in);
+		if (n == 0) {
+			error = 1;
+			break;
+		}
+		if (!error && fwrite(buf, 1, n, out) < n)
+			error = 1;
+		len -= n;
 	}
-	return strcmp((*two)->label, (*one)->label);
+
+	if (out != NULL && fclose(out) == EOF)
+		error = 1;
+	if (!error && rename(tmp, path) == -1)
+		error = 1;
+	if (error && out != NULL)
+		unlink(tmp);
+	return (error) ? -1 : 0;
 }
 
 static void
 manpage(char a[])
 {
 	printf("%s\n", a);
+	printf("[-b probe this file next to SHA256 and rank on the rate ");
+	printf("it arrives at\n");
+	printf("\t(eg. -b bsd.rd)]\n");
+
+	printf("[-B how many Bytes of the -b file to fetch ");
+	printf("(default 4194304)]\n");
+
+	printf("[-c stop probing a mirror once it is this many percent ");
+	printf("slower than the\n");
+	printf("\tfastest so far (eg. -c 20, default 0)]\n");
+
+	printf("[-C trust the CAs of this file for https instead of ");
+	printf("the system's\n");
+	printf("\t(eg. -C /etc/ssl/local.pem)]\n");
+
+	printf("[-d stay up and re-probe a few mirrors every D minutes, ");
+	printf("replacing\n");
+	printf("\t/etc/installurl only with one which keeps beating it ");
+	printf("(eg. -d 60)]\n");
+
+	printf("[-e (start probing the mirrors as ftp.html arrives, ");
+	printf("in the order it\n");
+	printf("\tlists them)]\n");
+
 	printf("[-f (don't write to File even if run as root)]\n");
 
+	printf("[-F (probe with Ftp(1) processes instead of ");
+	printf("from within pkg_ping)]\n");
+
+	printf("[-g fetch this file of the release from the fastest ");
+	printf("mirrors at once\n");
+	printf("\tand check it against SHA256 (eg. -g amd64/base66.tgz)]\n");
+
 	printf("[-h (print this Help message and exit)]\n");
 
+	printf("[-H how many percent faster -d needs a mirror to be ");
+	printf("before it\n");
+	printf("\treplaces the installed one (eg. -H 25, default 10)]\n");
+
+	printf("[-j number of mirrors to probe at the same time ");
+	printf("(eg. -j 4, default 1),\n");
+	printf("\tor \"auto\" to raise it while that pays off]\n");
+
+	printf("[-k probe only the K mirrors which were fastest before, ");
+	printf("unless they\n");
+	printf("\thave become slower (eg. -k 5)]\n");
+
+	printf("[-l probe the mirrors of this List file, one \"URL label\" ");
+	printf("per line,\n");
+	printf("\tinstead of those of ftp.html (eg. -l mirrors.txt)]\n");
+
+	printf("[-L stay up as a proxy on 127.0.0.1, port L, which spreads ");
+	printf("requests over\n");
+	printf("\tthe 3 fastest mirrors and installurl points at ");
+	printf("(eg. -L 8080)]\n");
+
+	printf("[-m what the mirrors are ranked on: total time, ");
+	printf("time to first byte\n");
+	printf("\tTCP connect time or -b transfer rate (eg. -m ttfb, ");
+	printf("default total)]\n");
+
+	printf("[-n take up to N samples of each mirror, dropping those ");
+	printf("which are clearly\n");
+	printf("\tslower along the way, and rank on the median ");
+	printf("(eg. -n 5, default 1)]\n");
+
 	printf("[-O (if your kernel is a snapshot, it will Override it and ");
 	printf("search for release kernel mirrors.\n");
 	printf("\tif your kernel is a release, it will Override it and ");
 	printf("search for snapshot kernel mirrors.)\n");
 
+	printf("[-p (with -n, rank on the 90th Percentile instead of ");
+	printf("the median)]\n");
+
+	printf("[-P connect to every mirror at once and only Probe the ");
+	printf("P quickest to\n");
+	printf("\tanswer (eg. -P 10)]\n");
+
 	printf("[-S (\"Secure\" https mirrors instead. Secrecy is preserved ");
 	printf("at the price of performance.\n");
 	printf("\t\"insecure\" mirrors still preserve file integrity!)]\n");
 
+	printf("[-r stay up and serve the ranking to the other hosts ");
+	printf("of the site\n");
+	printf("\ton this [address:]port, best with -d ");
+	printf("(eg. -r 8081 or -r 10.0.0.5:8081)]\n");
+
+	printf("[-R take the ranking which a host of the site serves ");
+	printf("with -r, unless\n");
+	printf("\tit is stale (eg. -R http://10.0.0.5:8081)]\n");
+
 	printf("[-s floating-point timeout in Seconds (eg. -s 2.3)]\n");
 
+	printf("[-t rank the mirrors for this release/arch instead, ");
+	printf("and for each\n");
+	printf("\tfurther -t as well (eg. -t 7.6/amd64 -t snapshots/arm64)]\n");
+
+	printf("[-T (a Tournament: the slower half of the mirrors is ");
+	printf("dropped each round\n");
+	printf("\tuntil one is left)]\n");
+
+	printf("[--list-url fetch the mirror list from this URL instead of\n");
+	printf("\tftp.html, without caching it (eg. --list-url ");
+	printf("http://127.0.0.1:18400/ftp.html)]\n");
+
+	printf("[--trace write a timeline of the run to this file, ");
+	printf("for chrome://tracing\n");
+	printf("\tor Perfetto (eg. --trace run.json)]\n");
+
 	printf("[-u (no USA mirrors to comply ");
 	printf("with USA encryption export laws)]\n");
 
 	printf("[-v (increase Verbosity. It recognizes up to 3 of these)]\n");
 	
 	printf("[-V (no Verbose output. No output but error messages)]\n");
+
+	printf("[-z the country or region to probe the mirrors of first, ");
+	printf("instead of the\n");
+	printf("\ttime zone's (eg. -z Germany or -z Europe)]\n");
 }
 
 int
 main(int argc, char *argv[])
 {
 	int8_t f = (getuid() == 0) ? 1 : 0;
-	int8_t num, current, insecure, u, verbose, override;
-	double s, S;
-	pid_t ftp_pid, sed_pid, write_pid;
-	int kq, i, pos, c, n, array_max, array_length, tag_len;
-	int parent_to_write[2], ftp_to_sed[2], sed_to_parent[2], block_pipe[2];
-	FILE *input, *pkg_write;
-	struct mirror_st **array;
-	struct kevent ke;
-	struct timeval tv_start, tv_end;
+	int8_t current, insecure, u, verbose, override, use_ftp, metric;
+	double s, diff, elapsed, best, limit, margin, spent;
+	int growing;
+	pid_t ftp_pid = -1, write_pid = -1;
+	int kq, i, c, n, array_length, tag_len;
+	int k, jobs, slot_max, launched, finished, running;
+	int top_k, probe_end, hist_length, hist_total;
+	int samples, round, swept, alive, scan_keep, idle, idle_max;
+	int interval, streak, tail_next;
+	int proxy_port, proxy_fd = -1;
+	int rank_port, rank_fd = -1;
+	in_addr_t rank_addr;
+	struct in_addr rank_in;
+	char *rank_colon;
+	const char *rank_url = NULL;
+	char *rank_buf[TARGET_MAX], **rank_line, *rank_body, *host_target;
+	size_t rank_len[TARGET_MAX];
+	time_t rank_time;
+	const char *target[TARGET_MAX];
+	int targets = 0;
+	struct mirror_st **order, **ranked;
+	double *saved;
+	char *target_tag, *target_buf = NULL;
+	size_t target_len;
+	FILE *target_out;
+	char proxy_url[32];
+	const char *get_file = NULL, *get_name = NULL;
+	char *get_path = NULL, *get_sums = NULL, *get_tmp = NULL;
+	char get_hex[SHA256_DIGEST_STRING_LENGTH];
+	char got_hex[SHA256_DIGEST_STRING_LENGTH];
+	long long get_size, want;
+	int get_fd = -1;
+	double hyst;
+	struct mirror_st *installed, *rival;
+	struct mirror_st *cand[DAEMON_TOP + 1 + DAEMON_TAIL];
+	double quantile, lo, hi, best_hi;
+	double hist_best, best_total;
+	time_t hist_now;
+	int parent_to_write[2], block_pipe[2];
+	FILE *pkg_write, *to_write = NULL;
+	char *etag = NULL, *modified = NULL, *extra = NULL;
+	int8_t cached, list_fail, tourney = 0;
+	int8_t early = 0, list_open, list_over = 0;
+	int8_t auto_jobs = 0;
+	int aimd_shown = 0;
+	struct aimd_st aimd;
+	const char *home_zone = NULL;
+	struct home_st home;
+	struct pipe_st pipeline;
+	struct probe_st *fetch;
+	struct timespec list_start, list_seen = { 0, 0 };
+	double dns_wait = -1;
+	int shown = 0;
+	const char *probe_file = NULL;
+	char *range = NULL;
+	long long cap = RATE_CAP;
+	const char *errstr;
+	struct mirror_st **array, *m;
+	struct hist_st *hist, *h;
+	struct dns_st *dns;
+	int dns_len;
+	struct list_st list, cache;
+	struct arena_st arena;
+	const char *list_file = NULL, *ca_file = NULL, *trace_file = NULL;
+	const char *list_url = LIST_URL;
+	int8_t list_keep = 1;
+	struct trace_st trace;
+	struct timespec span;
+	char trace_args[128];
+	static const struct option longopts[] = {
+		{ "trace", required_argument, NULL, OPT_TRACE },
+		{ "list-url", required_argument, NULL, OPT_LIST_URL },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct probe_st *slot;
+	struct event_st ev, *kev;
+	struct rlimit rl;
+	struct tls_config *tls_cfg = NULL;
+	struct timespec now;
 	struct timespec timeout, timeout0 = { 20, 0 };
 	
-	if (unveil("/usr/bin/ftp", "x") == -1)
-		err(EXIT_FAILURE, "unveil line: %d", __LINE__);
-
-	if (unveil("/usr/bin/sed", "x") == -1)
-		err(EXIT_FAILURE, "unveil line: %d", __LINE__);
-
-	if (f) {
-
-		if (unveil("/etc/installurl", "cw") == -1)
-			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
-
-		if (pledge("stdio proc exec cpath wpath", NULL) == -1)
-			err(EXIT_FAILURE, "pledge line: %d", __LINE__);
-	} else if (pledge("stdio proc exec", NULL) == -1)
-		err(EXIT_FAILURE, "pledge line: %d", __LINE__);
 
 	
+	memset(&trace, 0, sizeof(trace));
+	clock_gettime(CLOCK_MONOTONIC, &trace.t0);
+
 	s = 5;
+	interval = 0;
+	proxy_port = 0;
+	rank_port = 0;
+	rank_addr = INADDR_ANY;
+	memset(rank_buf, 0, sizeof(rank_buf));
+	hyst = 0.1;
+	jobs = 1;
+	top_k = 0;
+	scan_keep = 0;
+	margin = 0;
+	samples = 1;
+	quantile = 0.5;
+	use_ftp = 0;
+	metric = -1;
 	u = 0;
 	verbose = 0;
 	insecure = 1;
 	current = 0;
 	override = 0;
 
+#ifdef __OpenBSD__
 	char *version;
 	size_t len = 300;
 	version = malloc(len);
@@ -205,25 +4875,166 @@ main(int argc, char *argv[])
 		current = 1;
 		
 	free(version);
+#endif
 
-	while ((c = getopt(argc, argv, "fhOSs:uvV")) != -1) {
+	while ((c = getopt_long(argc, argv,
+	    "b:B:c:C:d:efFg:hH:j:k:l:L:m:n:OpP:r:R:Ss:t:TuvVz:", longopts,
+	    NULL)) != -1) {
 		switch (c) {
+		case OPT_TRACE:
+			trace_file = optarg;
+			break;
+		case OPT_LIST_URL:
+			if (strncmp(optarg, "http://", 7) &&
+			    strncmp(optarg, "https://", 8))
+				errx(EXIT_FAILURE, "--list-url should be an "
+				    "http:// or https:// URL: %s", optarg);
+			list_url = optarg;
+			list_keep = 0;
+			break;
+		case 'C':
+			ca_file = optarg;
+			break;
+		case 'c':
+			margin = strtonum(optarg, 0, 1000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-c is %s: %s", errstr, optarg);
+			margin /= 100;
+			break;
+		case 'd':
+			interval = strtonum(optarg, 1, 7 * 24 * 60, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-d is %s: %s", errstr, optarg);
+			interval *= 60;
+			break;
+		case 'e':
+			early = 1;
+			break;
 		case 'f':
-			if (f == 0)
-				break;
-			if (pledge("stdio proc exec", NULL) == -1)
-				err(EXIT_FAILURE, "pledge line: %d", __LINE__);
 			f = 0;
 			break;
+		case 'F':
+			use_ftp = 1;
+			break;
+		case 'g':
+			if (*optarg == '\0' || *optarg == '/' ||
+			    optarg[strlen(optarg) - 1] == '/' ||
+			    strstr(optarg, "..") != NULL)
+				errx(EXIT_FAILURE, "-g should name a file of "
+				    "the release: %s", optarg);
+			get_file = optarg;
+			break;
 		case 'h':
 			manpage(argv[0]);
 			return 0;
+		case 'H':
+			hyst = strtonum(optarg, 0, 1000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-H is %s: %s", errstr, optarg);
+			hyst /= 100;
+			break;
+		case 'j':
+			/* -j auto: up to AIMD_MAX, as far as it pays off */
+			if (strcmp(optarg, "auto") == 0) {
+				auto_jobs = 1;
+				jobs = AIMD_MAX;
+				break;
+			}
+			jobs = strtonum(optarg, 1, 100, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-j is %s: %s", errstr, optarg);
+			break;
+		case 'b':
+			if (*optarg == '\0' || strchr(optarg, '/') != NULL)
+				errx(EXIT_FAILURE, "-b should name a file: %s",
+				    optarg);
+			probe_file = optarg;
+			break;
+		case 'B':
+			cap = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-B is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			list_file = optarg;
+			break;
+		case 'L':
+			proxy_port = strtonum(optarg, 1, 65535, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-L is %s: %s", errstr, optarg);
+			break;
+		case 'k':
+			top_k = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-k is %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "total"))
+				metric = METRIC_TOTAL;
+			else if (!strcmp(optarg, "ttfb"))
+				metric = METRIC_TTFB;
+			else if (!strcmp(optarg, "connect"))
+				metric = METRIC_CONNECT;
+			else if (!strcmp(optarg, "rate"))
+				metric = METRIC_RATE;
+			else {
+				errx(EXIT_FAILURE,
+				    "-m should be total, ttfb, connect or rate");
+			}
+			break;
+		case 'n':
+			samples = strtonum(optarg, 1, SAMPLE_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-n is %s: %s", errstr, optarg);
+			break;
 		case 'O':
 			override = 1;
 			break;
+		case 'p':
+			quantile = 0.9;
+			break;
+		case 'P':
+			scan_keep = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-P is %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			/* "10.0.0.5:8081" serves on that address alone */
+			rank_addr = INADDR_ANY;
+			rank_colon = strrchr(optarg, ':');
+			if (rank_colon != NULL) {
+				*rank_colon = '\0';
+				if (inet_pton(AF_INET, optarg, &rank_in) != 1)
+					errx(EXIT_FAILURE, "-r address is invalid: "
+					    "%s", optarg);
+				rank_addr = ntohl(rank_in.s_addr);
+				optarg = rank_colon + 1;
+			}
+			rank_port = strtonum(optarg, 1, 65535, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-r is %s: %s", errstr, optarg);
+			break;
+		case 'R':
+			if (strncmp(optarg, "http://", 7) &&
+			    strncmp(optarg, "https://", 8))
+				errx(EXIT_FAILURE, "-R should be an http:// or "
+				    "https:// URL: %s", optarg);
+			rank_url = optarg;
+			break;
 		case 'S':
 			insecure = 0;
 			break;
+		case 't':
+			if (targets == TARGET_MAX)
+				errx(EXIT_FAILURE, "at most %d -t", TARGET_MAX);
+			if (!target_ok(optarg))
+				errx(EXIT_FAILURE, "-t should be a release/arch, "
+				    "eg. 7.6/amd64: %s", optarg);
+			target[targets++] = optarg;
+			break;
+		case 'T':
+			tourney = 1;
+			break;
 		case 's':
 			c = -1;
 			i = n = 0;
@@ -235,45 +5046,267 @@ main(int argc, char *argv[])
 				if (optarg[c] == '.' && ++i == 1)
 					continue;
 
-				if (optarg[c] == '-')
-					errx(EXIT_FAILURE,
-					    "No negative sign.");
-				errx(EXIT_FAILURE,
-				    "Bad floating point format.");
-			}
-			if (n == 0)
-				errx(EXIT_FAILURE,
-				    "-s needs a numeric character.");
-			errno = 0;
-			s = strtod(optarg, NULL);
-			if (errno == ERANGE)
-				err(EXIT_FAILURE, "strtod");
-			if (s > 1000.0)
-				errx(EXIT_FAILURE, "-s should be <= 1000");
-			if (s <= 0.01)
-				errx(EXIT_FAILURE, "-s should be > 0.01");
-			break;
-		case 'u':
-			u = 1;
-			break;
-		case 'v':
-			if (verbose == -1)
-				break;
-			if (++verbose > 3)
-				verbose = 3;
-			break;
-		case 'V':
-			verbose = -1;
-			break;
-		default:
-			manpage(argv[0]);
-			return EXIT_FAILURE;
-		}
+				if (optarg[c] == '-')
+					errx(EXIT_FAILURE,
+					    "No negative sign.");
+				errx(EXIT_FAILURE,
+				    "Bad floating point format.");
+			}
+			if (n == 0)
+				errx(EXIT_FAILURE,
+				    "-s needs a numeric character.");
+			errno = 0;
+			s = strtod(optarg, NULL);
+			if (errno == ERANGE)
+				err(EXIT_FAILURE, "strtod");
+			if (s > 1000.0)
+				errx(EXIT_FAILURE, "-s should be <= 1000");
+			if (s <= 0.01)
+				errx(EXIT_FAILURE, "-s should be > 0.01");
+			break;
+		case 'u':
+			u = 1;
+			break;
+		case 'v':
+			if (verbose == -1)
+				break;
+			if (++verbose > 3)
+				verbose = 3;
+			break;
+		case 'V':
+			verbose = -1;
+			break;
+		case 'z':
+			home_zone = optarg;
+			break;
+		default:
+			manpage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc) {
+		manpage(argv[0]);
+		errx(EXIT_FAILURE, "non-option ARGV-element: %s", argv[optind]);
+	}
+
+	/* opened before unveil() and pledge() could forbid it */
+	if (trace_file != NULL) {
+		trace.fp = fopen(trace_file, "we");
+		if (trace.fp == NULL)
+			err(EXIT_FAILURE, "fopen %s", trace_file);
+		fprintf(trace.fp, "[\n");
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		trace_span(&trace, "startup", 0, &trace.t0, &now, NULL);
+	}
+
+	/*
+	 * -g: like ftp(1), into the current directory, by way of a
+	 * temporary file beside it which only replaces it once its SHA256
+	 * matches, so a failed fetch leaves what was there alone
+	 */
+	if (get_file != NULL) {
+		get_name = strrchr(get_file, '/');
+		get_name = (get_name != NULL) ? get_name + 1 : get_file;
+		if (asprintf(&get_tmp, "%s.tmp", get_name) == -1)
+			err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+	}
+
+	if (interval > 0 && proxy_port > 0)
+		errx(EXIT_FAILURE, "-L relays to one sweep's mirrors, not -d");
+
+	if (rank_port > 0 && proxy_port > 0)
+		errx(EXIT_FAILURE, "-r and -L both stay up to serve, pick one");
+
+	/* -R takes the site's ranking, or probes as if it weren't given */
+	if (rank_url != NULL && (interval > 0 || proxy_port > 0 ||
+	    rank_port > 0 || get_file != NULL || targets > 1))
+		errx(EXIT_FAILURE, "-R can't be combined with -d, -g, -L, -r "
+		    "or a second -t");
+
+	/* -L and -r: bound now, so that a port in use fails before the sweep */
+	if (proxy_port > 0) {
+		proxy_fd = listen_on(INADDR_LOOPBACK, proxy_port, PROXY_MAX);
+		if (proxy_fd == -1)
+			err(EXIT_FAILURE, "-L 127.0.0.1:%d", proxy_port);
+	}
+	if (rank_port > 0) {
+		rank_fd = listen_on(rank_addr, rank_port, RANK_MAX);
+		if (rank_fd == -1)
+			err(EXIT_FAILURE, "-r port %d", rank_port);
+	}
+
+	if (unveil("/usr/bin/ftp", "x") == -1)
+		err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+	/* -C: eg. the CA of a -l list of internal or loopback mirrors */
+	if (ca_file == NULL)
+		ca_file = tls_default_ca_cert_file();
+	if (unveil(ca_file, "r") == -1)
+		err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+	if (list_file != NULL && unveil(list_file, "r") == -1)
+		err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+	if (get_file != NULL && (unveil(get_tmp, "rwc") == -1 ||
+	    unveil(get_name, "c") == -1))
+		err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+	/* without -z, the time zone tells where the near mirrors are */
+	if (home_zone == NULL && (unveil(LOCALTIME, "r") == -1 ||
+	    unveil(ZONE_TAB, "r") == -1))
+		err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+	if (f) {
+
+		if (unveil("/etc/installurl", "cw") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (interval > 0 && unveil(INSTALLURL_TMP, "rwc") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (unveil(HIST_PATH, "rwc") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (unveil(HIST_TMP, "rwc") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (unveil(LIST_PATH, "rwc") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (unveil(LIST_TMP, "rwc") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (pledge("stdio proc exec cpath wpath rpath inet dns",
+		    NULL) == -1)
+			err(EXIT_FAILURE, "pledge line: %d", __LINE__);
+	} else {
+
+		if (unveil(HIST_PATH, "r") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (unveil(LIST_PATH, "r") == -1)
+			err(EXIT_FAILURE, "unveil line: %d", __LINE__);
+
+		if (pledge((get_file != NULL) ? "stdio proc exec cpath wpath "
+		    "rpath inet dns" : "stdio proc exec rpath inet dns",
+		    NULL) == -1)
+			err(EXIT_FAILURE, "pledge line: %d", __LINE__);
+	}
+
+	/* a larger file is there to measure throughput */
+	if (metric == -1)
+		metric = (probe_file != NULL) ? METRIC_RATE : METRIC_TOTAL;
+
+	if (use_ftp && probe_file != NULL)
+		errx(EXIT_FAILURE, "ftp(1) probes would fetch all of -b");
+
+	if (probe_file != NULL) {
+		if (asprintf(&range, "Range: bytes=0-%lld\r\n", cap - 1) == -1)
+			err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+	} else
+		probe_file = "SHA256";
+
+	if (use_ftp && metric != METRIC_TOTAL)
+		errx(EXIT_FAILURE, "ftp(1) probes can only be ranked on -m total");
+
+	if (tourney && samples > 1)
+		errx(EXIT_FAILURE, "-T decides how often to probe, not -n");
+
+	if (!list_keep && list_file != NULL)
+		errx(EXIT_FAILURE, "-l and --list-url each name the list");
+
+	/* -e: nothing can be known of all of the mirrors before probing */
+	if (early && (use_ftp || top_k > 0 || list_file != NULL ||
+	    samples > 1 || scan_keep > 0 || tourney))
+		errx(EXIT_FAILURE, "-e can't be combined with -F, -k, -l, -n, "
+		    "-P or -T");
+
+	if (interval > 0 && use_ftp)
+		errx(EXIT_FAILURE, "-d re-probes from within pkg_ping, not -F");
+
+	if (auto_jobs && use_ftp)
+		errx(EXIT_FAILURE, "-j auto measures from within pkg_ping, "
+		    "not -F");
+
+	if (targets > 1 && use_ftp)
+		errx(EXIT_FAILURE, "-t probes from within pkg_ping, not -F");
+
+#ifndef __OpenBSD__
+	/*
+	 * there is no OpenBSD kernel here to take the release from, so
+	 * without -t it is the snapshots for this machine's architecture
+	 */
+	if (targets == 0) {
+		struct utsname host;
+		const char *arch;
+
+		if (override)
+			errx(EXIT_FAILURE, "-O needs -t off OpenBSD, "
+			    "eg. -t 7.6/amd64");
+		if (uname(&host) == -1)
+			err(EXIT_FAILURE, "uname line: %d", __LINE__);
+		arch = host_arch(host.machine);
+		if (arch == NULL)
+			errx(EXIT_FAILURE, "-t is needed off OpenBSD on %s, "
+			    "eg. -t snapshots/amd64", host.machine);
+		if (asprintf(&host_target, "snapshots/%s", arch) == -1)
+			err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+		target[targets++] = host_target;
+		current = 1;
 	}
-	if (optind < argc) {
-		manpage(argv[0]);
-		errx(EXIT_FAILURE, "non-option ARGV-element: %s", argv[optind]);
+#endif
+
+	/* -T runs until one mirror is left */
+	if (tourney)
+		samples = SAMPLE_MAX;
+
+	/* the CA file is read into memory here, so rpath can go */
+	if (tls_init() == -1)
+		errx(EXIT_FAILURE, "tls_init line: %d", __LINE__);
+	tls_cfg = tls_config_new();
+	if (tls_cfg == NULL)
+		errx(EXIT_FAILURE, "tls_config_new line: %d", __LINE__);
+	if (tls_config_set_ca_file(tls_cfg, ca_file) == -1)
+		errx(EXIT_FAILURE, "%s line: %d", tls_config_error(tls_cfg),
+		    __LINE__);
+
+	hist = hist_read(&hist_length);
+	if (hist == NULL)
+		err(EXIT_FAILURE, "hist_read line: %d", __LINE__);
+
+	if (home_find(home_zone, &home) == -1) {
+		errx(EXIT_FAILURE, "-z should be a country or region of "
+		    "ftp.html, eg. Germany or Europe: %s", home_zone);
 	}
+	if (verbose >= 2 && home.region != NULL) {
+		printf("probing the mirrors of %s%s%s first.\n",
+		    (home.country != NULL) ? home.country : "",
+		    (home.country != NULL) ? " and " : "", home.region);
+	}
+
+	/* -l: the list is that file, ftp.html isn't fetched */
+	memset(&cache, 0, sizeof(cache));
+	clock_gettime(CLOCK_MONOTONIC, &span);
+	if (list_file != NULL) {
+		if (list_read(&cache, list_file, NULL, NULL) == -1)
+			errx(EXIT_FAILURE, "no mirrors read from %s", list_file);
+		cached = 1;
+	} else if (list_keep)
+		cached = (list_read(&cache, LIST_PATH, &etag, &modified) == 0);
+	else
+		cached = 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	snprintf(trace_args, sizeof(trace_args), "\"mirrors\":%d",
+	    cache.length);
+	trace_span(&trace, (list_file != NULL) ? list_file : LIST_PATH, 0,
+	    &span, &now, trace_args);
+
+	if (f) {
+		if (pledge("stdio proc exec cpath wpath inet dns", NULL) == -1)
+			err(EXIT_FAILURE, "pledge line: %d", __LINE__);
+	} else if (pledge((get_file != NULL) ? "stdio proc exec cpath wpath "
+	    "inet dns" : "stdio proc exec inet dns", NULL) == -1)
+		err(EXIT_FAILURE, "pledge line: %d", __LINE__);
 
 
 	if (verbose > 1) {
@@ -304,10 +5337,16 @@ main(int argc, char *argv[])
 		if (pipe(parent_to_write) == -1)
 			err(EXIT_FAILURE, "pipe line: %d", __LINE__);
 
+		/* or the child would print it again when it flushes */
+		fflush(stdout);
+
+		clock_gettime(CLOCK_MONOTONIC, &span);
 		write_pid = fork();
 		if (write_pid == (pid_t) 0) {
 			
-			char *tag_w;
+			char *tag_w, *len_w;
+			int8_t written = 0;
+			FILE *from_parent;
 			
 			if (pledge("stdio cpath wpath", NULL) == -1) {
 				printf("pledge line: %d\n", __LINE__);
@@ -315,31 +5354,14 @@ main(int argc, char *argv[])
 			}
 			
 			close(parent_to_write[STDOUT_FILENO]);
-						
-			kq = kqueue();
-			if (kq == -1) {
-				printf("kq! line: %d\n", __LINE__);
-				_exit(EXIT_FAILURE);
-			}
-			
-			EV_SET(&ke, parent_to_write[STDIN_FILENO], EVFILT_READ,
-				EV_ADD | EV_ONESHOT, 0, 0, NULL);
-			if (kevent(kq, &ke, 1, &ke, 1, NULL) == -1) {
-				printf("write_pid kevent register fail");
-				printf(" line: %d\n", __LINE__);
-				_exit(EXIT_FAILURE);
-			}
-			close(kq);
-			
-			/* parent exited before sending data */
-			if (ke.data == 0) {
-				printf("/etc/installurl not written.\n");
-				_exit(EXIT_FAILURE);
-			}
-			
-			if (dup2(parent_to_write[STDIN_FILENO],
-			    STDIN_FILENO) == -1) {
-				printf("write_pid dup2 line: %d\n", __LINE__);
+			if (proxy_fd != -1)
+				close(proxy_fd);
+			if (rank_fd != -1)
+				close(rank_fd);
+
+			from_parent = fdopen(parent_to_write[STDIN_FILENO], "r");
+			if (from_parent == NULL) {
+				printf("write_pid fdopen line: %d\n", __LINE__);
 				_exit(EXIT_FAILURE);
 			}
 			
@@ -348,35 +5370,81 @@ main(int argc, char *argv[])
 				printf("malloc line: %d\n", __LINE__);
 				_exit(EXIT_FAILURE);
 			}
-				
-			i = 0;
-			if (verbose >= 1)
-				printf("\n");
-			while ((c = getchar()) != EOF) {
-				if (i >= 300) {
+
+			/*
+			 * each file arrives as a "name length" line and then
+			 * its contents. /etc/installurl is always sent last.
+			 * If the parent exits first, nothing is written to it.
+			 */
+			while (fgets(tag_w, 300 + 1, from_parent) != NULL) {
+
+				len_w = strchr(tag_w, ' ');
+				if (len_w == NULL)
+					break;
+				*len_w++ = '\0';
+				len_w[strcspn(len_w, "\n")] = '\0';
+				i = strtonum(len_w, 0, INT_MAX, &errstr);
+				if (errstr != NULL)
+					break;
+
+				if (!strcmp(tag_w, "history")) {
+					if (write_file(from_parent, i, HIST_TMP,
+					    HIST_PATH) == -1 && verbose >= 1)
+						printf("%s not written.\n",
+						    HIST_PATH);
+					continue;
+				}
+				if (!strcmp(tag_w, "list")) {
+					if (write_file(from_parent, i, LIST_TMP,
+					    LIST_PATH) == -1 && verbose >= 1)
+						printf("%s not written.\n",
+						    LIST_PATH);
+					continue;
+				}
+				if (strcmp(tag_w, "installurl"))
+					break;
+
+				if (i > 300) {
 					printf("\nmirror length ");
 					printf("became too long.\n");
-					
-					printf("/etc/installurl");
-					printf(" not written.\n");
-					_exit(EXIT_FAILURE);
+					break;
 				}
-
-				tag_w[i++] = c;
-				if (c == '\n')
+				if (fread(tag_w, 1, i, from_parent) < (size_t)i)
 					break;
-			}
-			tag_w[i] = '\0';			
-			
-			/* fopen(... "w") truncates the file */
-			pkg_write = fopen("/etc/installurl", "w");
+				tag_w[i] = '\0';
 
-			if (pledge("stdio", NULL) == -1) {
-				printf("pledge line: %d\n", __LINE__);
-				_exit(EXIT_FAILURE);
-			}
-			
-			if (pkg_write != NULL) {
+				if (verbose >= 1)
+					printf("\n");
+
+				/* -d: one of many, swapped in whole */
+				if (interval > 0) {
+					FILE *mem = fmemopen(tag_w, i, "r");
+
+					if (mem == NULL || write_file(mem, i,
+					    INSTALLURL_TMP, "/etc/installurl") == -1)
+						printf("/etc/installurl not "
+						    "written.\n");
+					else if (verbose >= 0)
+						printf("/etc/installurl: %s",
+						    tag_w);
+					if (mem != NULL)
+						fclose(mem);
+					fflush(stdout);
+					continue;
+				}
+
+				/* fopen(... "w") truncates the file */
+				pkg_write = fopen("/etc/installurl", "w");
+
+				if (pledge("stdio", NULL) == -1) {
+					printf("pledge line: %d\n", __LINE__);
+					_exit(EXIT_FAILURE);
+				}
+
+				if (pkg_write == NULL) {
+					printf("/etc/installurl not opened.\n");
+					_exit(EXIT_FAILURE);
+				}
 				n = fwrite(tag_w, sizeof(char), i, pkg_write);
 				fclose(pkg_write);
 				if (n < i && verbose >= 0)
@@ -385,536 +5453,1320 @@ main(int argc, char *argv[])
 					_exit(EXIT_FAILURE);
 				if (verbose >= 0)
 					printf("/etc/installurl: %s", tag_w);
-				_exit(EXIT_SUCCESS);
+				written = 1;
 			}
-			
-			printf("/etc/installurl not opened.\n");
-			_exit(EXIT_FAILURE);
+
+			if (!written)
+				printf("/etc/installurl not written.\n");
+			fflush(stdout);
+			_exit((written) ? EXIT_SUCCESS : EXIT_FAILURE);
 		}
 		if (write_pid == -1)
 			err(EXIT_FAILURE, "write fork line: %d", __LINE__);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		trace_span(&trace, "fork writer", 0, &span, &now, NULL);
 			
-		if (pledge("stdio proc exec", NULL) == -1)
+		if (pledge((get_file != NULL) ? "stdio proc exec cpath wpath "
+		    "inet dns" : "stdio proc exec inet dns", NULL) == -1)
 			err(EXIT_FAILURE, "pledge line: %d", __LINE__);
 
 		close(parent_to_write[STDIN_FILENO]);
+
+		to_write = fdopen(parent_to_write[STDOUT_FILENO], "w");
+		if (to_write == NULL)
+			err(EXIT_FAILURE, "fdopen line: %d", __LINE__);
 	}
 
 
 
 
-	if (pipe(ftp_to_sed) == -1)
-		err(EXIT_FAILURE, "pipe line: %d", __LINE__);
+	struct utsname *name = malloc(sizeof(struct utsname));
+	if (name == NULL) {
+		errno = ENOMEM;
+		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &span);
+	if (uname(name) == -1)
+		err(EXIT_FAILURE, "uname line: %d", __LINE__);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	trace_span(&trace, "uname", 0, &span, &now, NULL);
+	
+	char *release = malloc(4 + 1);
+	if (release == NULL) {
+		errno = ENOMEM;
+		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+	}
+	strlcpy(release, name->release, 4 + 1);
 
-	ftp_pid = fork();
-	if (ftp_pid == (pid_t) 0) {
+	/* the first -t stands in for what uname() and -O make of this host */
+	if (targets > 0) {
+		c = strchr(target[0], '/') - target[0];
+		current = !strncmp(target[0], "snapshots/", 10);
+		if (current == 0)
+			strlcpy(release, target[0], c + 1);
+		strlcpy(name->machine, target[0] + c + 1,
+		    sizeof(name->machine));
+	}
 
-		if (pledge("stdio exec", NULL) == -1) {
-			printf("ftp pledge 1 line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
-		}
-		
-		close(ftp_to_sed[STDIN_FILENO]);
+	if (current == 0) {
+		tag_len = strlen("/") + strlen(release) + strlen("/") +
+		    strlen(name->machine) + strlen("/") + strlen(probe_file);
+	} else {
+		tag_len = strlen("/") + strlen("snapshots") + strlen("/") +
+		    strlen(name->machine) + strlen("/") + strlen(probe_file);
+	}
 
-		if (dup2(ftp_to_sed[STDOUT_FILENO], STDOUT_FILENO) == -1) {
-			printf("ftp STDOUT dup2 line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
+	char *tag = malloc(tag_len + 1);
+	if (tag == NULL) {
+		errno = ENOMEM;
+		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+	}
+
+	strlcpy(tag,           "/", tag_len + 1);	
+
+	if (current == 0)
+		strlcat(tag,     release, tag_len + 1);
+	else
+		strlcat(tag, "snapshots", tag_len + 1);
+
+	strlcat(tag,           "/", tag_len + 1);
+	strlcat(tag, name->machine, tag_len + 1);
+	strlcat(tag,           "/", tag_len + 1);
+	strlcat(tag,    probe_file, tag_len + 1);
+
+	/* -r and -R name the ranking after it */
+	if (targets == 0) {
+		if (asprintf(&host_target, "%s/%s", (current == 0) ? release :
+		    "snapshots", name->machine) == -1)
+			err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+		target[targets++] = host_target;
+	}
+
+	free(name);
+
+	/* -g: its path and that of the SHA256 file beside it */
+	if (get_file != NULL) {
+		if (asprintf(&get_path, "/%s/%s", (current == 0) ? release :
+		    "snapshots", get_file) == -1 ||
+		    asprintf(&get_sums, "%.*sSHA256",
+		    (int)(strrchr(get_path, '/') + 1 - get_path),
+		    get_path) == -1)
+			err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+	}
+
+
+
+	kq = ev_open();
+	if (kq == -1)
+		err(EXIT_FAILURE, "ev_open line: %d", __LINE__);
+
+	/* -R: a fresh ranking from the site's -r spares this host a sweep */
+	if (rank_url != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &span);
+		rank_body = rank_get(rank_url, target[0], kq, s, tls_cfg);
+		rank_line = NULL;
+		n = -1;
+		if (rank_body != NULL) {
+			for (i = 1, c = 0; rank_body[c] != '\0'; ++c)
+				i += (rank_body[c] == '\n');
+			rank_line = calloc(i, sizeof(char *));
+			if (rank_line == NULL)
+				err(EXIT_FAILURE, "calloc line: %d", __LINE__);
+			n = rank_parse(rank_body, target[0], u, insecure,
+			    rank_line, i, &rank_time);
 		}
-		
-		if (verbose >= 2) {
-			fprintf(stderr,
-			    "fetching https://www.openbsd.org/ftp.html\n");
-			execl("/usr/bin/ftp", "ftp", "-vmo", "-",
-			    "https://www.openbsd.org/ftp.html", NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		snprintf(trace_args, sizeof(trace_args), "\"mirrors\":%d", n);
+		trace_span(&trace, rank_url, 0, &span, &now, trace_args);
+
+		if (n <= 0) {
+			if (verbose >= 0) {
+				warnx("no fresh ranking from %s, probing",
+				    rank_url);
+			}
+			free(rank_line);
+			free(rank_body);
 		} else {
-			execl("/usr/bin/ftp", "ftp", "-VMo", "-",
-			    "https://www.openbsd.org/ftp.html", NULL);
-		}
+			if (verbose >= 1) {
+				printf("\n\nRANKED %lld SECONDS AGO:\n\n",
+				    (long long)(time(NULL) - rank_time));
+				for (c = n - 1; c >= 0; --c)
+					printf("%s\n", rank_line[c]);
+				printf("\n");
+			}
 
-		if (pledge("stdio", NULL) == -1) {
-			fprintf(stderr, "ftp pledge 2 line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
+			/* "diff URL label" */
+			rank_body = strchr(rank_line[0], ' ') + 1;
+			rank_body[strcspn(rank_body, " ")] = '\0';
+			if (f) {
+				fprintf(to_write, "installurl %zu\n%s\n",
+				    strlen(rank_body) + 1, rank_body);
+				fclose(to_write);
+				fflush(stdout);
+				waitpid(write_pid, &i, 0);
+				trace_close(&trace);
+				return i;
+			}
+			if (verbose >= 0) {
+				printf("As root, type:\necho \"%s\" > "
+				    "/etc/installurl\n", rank_body);
+			}
+			trace_close(&trace);
+			return EXIT_SUCCESS;
 		}
-		fprintf(stderr, "ftp execl() failed line: %d\n", __LINE__);
-		_exit(EXIT_FAILURE);
 	}
-	if (ftp_pid == -1)
-		err(EXIT_FAILURE, "ftp 1 fork line: %d", __LINE__);
 
-	close(ftp_to_sed[STDOUT_FILENO]);
+	memset(&list, 0, sizeof(list));
+
+	fetch = calloc(1, sizeof(struct probe_st));
+	if (fetch == NULL) err(EXIT_FAILURE, "calloc line: %d", __LINE__);
+	fetch->kind = UDATA_PROBE;
+	fetch->http.fd = -1;
+	fetch->http.sink = list_feed;
+	fetch->http.sink_arg = &list;
+
+	/* only a changed ftp.html is sent in full */
+	if (cached && (etag != NULL || modified != NULL)) {
+		if (asprintf(&extra, "%s%s%s%s%s%s",
+		    (etag != NULL) ? "If-None-Match: " : "",
+		    (etag != NULL) ? etag : "", (etag != NULL) ? "\r\n" : "",
+		    (modified != NULL) ? "If-Modified-Since: " : "",
+		    (modified != NULL) ? modified : "",
+		    (modified != NULL) ? "\r\n" : "") == -1)
+			err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+		fetch->http.extra = extra;
+	}
+
+	/* with LIST_PATH to fall back on, a stalled ftp.html isn't waited on */
+	if (cached)
+		timeout0.tv_sec = LIST_STALL;
+
+	if (verbose >= 2 && list_file == NULL)
+		fprintf(stderr, "fetching %s\n", list_url);
 
-	if (pipe(sed_to_parent) == -1) {
-		n = errno;
-		kill(ftp_pid, SIGKILL);
-		errno = n;
-		err(EXIT_FAILURE, "pipe line: %d", __LINE__);
+	list_fail = 0;
+	n = 0;
+	clock_gettime(CLOCK_MONOTONIC, &list_start);
+	if (list_file != NULL)
+		list_fail = 1;
+	else if (http_get(&fetch->http, list_url, tls_cfg) == -1) {
+		if (!cached)
+			errx(EXIT_FAILURE, "couldn't reach %s", list_url);
+		list_fail = 1;
+	} else
+		n = HTTP_WANT_WRITE;
+
+	/* -e: the sweep reads the page, probing the mirrors as they come */
+	list_open = (early && n != 0);
+	if (list_open) {
+		if (ev_add(kq, fetch->http.fd, EVENT_WRITE, fetch) == -1)
+			err(EXIT_FAILURE, "ev_add line: %d", __LINE__);
+		list_seen = list_start;
 	}
-	sed_pid = fork();
-	if (sed_pid == (pid_t) 0) {
 
-		if (pledge("stdio exec", NULL) == -1) {
-			printf("sed pledge 1 line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
+	/* timeout0 is how long the page may stall, not its total time */
+	while (!list_open && (n == HTTP_WANT_READ || n == HTTP_WANT_WRITE)) {
+		i = ev_add(kq, fetch->http.fd,
+		    (n == HTTP_WANT_READ) ? EVENT_READ : EVENT_WRITE, NULL);
+		if (i == 0)
+			i = ev_wait(kq, &ev, 1, &timeout0);
+		if (i == -1) {
+			err(EXIT_FAILURE,
+			    "ev_wait, timeout0 may be too large. line: %d\n",
+			    __LINE__);
+		}
+		if (i == 0) {
+			if (!cached) {
+				errx(EXIT_FAILURE, "timed out fetching: %s",
+				    list_url);
+			}
+			list_fail = 1;
+			break;
 		}
-		close(sed_to_parent[STDIN_FILENO]);
+		n = http_step(&fetch->http);
+
+		/* the rsync mirrors follow, so the rest isn't needed */
+		if (list.stop || list.error)
+			break;
+	}
+	if (!list_open) {
+		list_settle(&list, &cache, &fetch->http, list_url, list_fail,
+		    cached, list_file, verbose, (f && list_keep) ? to_write :
+		    NULL, &trace, &list_start);
+	}
+
+	/* in-process probes need neither fork() nor exec() */
+	if (!use_ftp) {
+		if (pledge((get_file != NULL) ? "stdio cpath wpath inet dns" :
+		    "stdio inet dns", NULL) == -1)
+			err(EXIT_FAILURE, "pledge line: %d", __LINE__);
+
+		/* a mirror hanging up mid-request must not kill us */
+		signal(SIGPIPE, SIG_IGN);
+	} else if (pledge((get_file != NULL) ? "stdio proc exec cpath wpath "
+	    "inet dns" : (scan_keep > 0 || proxy_fd != -1 || rank_fd != -1) ?
+	    "stdio proc exec inet dns" : "stdio proc exec", NULL) == -1)
+		err(EXIT_FAILURE, "pledge line: %d", __LINE__);
 
-		if (dup2(ftp_to_sed[STDIN_FILENO], STDIN_FILENO) == -1) {
-			printf("sed STDIN dup2 line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
+	clock_gettime(CLOCK_MONOTONIC, &span);
+	memset(&arena, 0, sizeof(arena));
+	hist_now = time(NULL);
+	if (early) {
+		memset(&pipeline, 0, sizeof(pipeline));
+		pipeline.arena = &arena;
+		pipeline.hist = hist;
+		pipeline.hist_length = hist_length;
+		pipeline.home = &home;
+		pipeline.samples = samples;
+		pipeline.u = u;
+		pipeline.insecure = insecure;
+		if (pipe_take(&pipeline, &list, kq) == -1) {
+			errno = ENOMEM;
+			err(EXIT_FAILURE, "pipe_take line: %d", __LINE__);
 		}
-		if (dup2(sed_to_parent[STDOUT_FILENO], STDOUT_FILENO) == -1) {
-			printf("sed STDOUT dup2 line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
+		array = pipeline.array;
+		array_length = pipeline.length;
+	} else {
+		array = mirror_table(&list, u, insecure, &arena,
+		    &array_length);
+		if (array == NULL) {
+			errno = ENOMEM;
+			err(EXIT_FAILURE, "mirror_table line: %d", __LINE__);
 		}
-		execl("/usr/bin/sed", "sed", "-n",
-		    "-e", "s:</a>$::",
-		    "-e", "s:\t<strong>\\([^<]*\\)<.*:\\1:p",
-		    "-e", "s:^\\(\t[hfr].*\\):\\1:p", NULL);
+		hist = hist_attach(hist, hist_length, &hist_total, array,
+		    array_length);
+		if (hist == NULL)
+			err(EXIT_FAILURE, "hist_attach line: %d", __LINE__);
+	}
+	if (!list_open)
+		list_free(&list);
+
+	if (array_length == 0 && !list_open)
+		errx(EXIT_FAILURE, "No mirror found. Is www.openbsd.org live?");
+
+	int pos_max = 0;
+	for (c = 0; c < array_length; ++c) {
+		n = strlen(array[c]->ftp_file) + 1;
+		if (pos_max < n)
+			pos_max = n;
+	}
+
+	pos_max += tag_len;
+	char *line = malloc(pos_max);
+	if (line == NULL) err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+
+	/*
+	 * the mirrors likely to be near are probed first, so that the
+	 * fastest so far soon cuts the others short. -e picks the nearest
+	 * of those which have come in.
+	 */
+	if (!early) {
+		for (c = 0; c < array_length; ++c)
+			array[c]->near = near_tier(array[c], &home, hist_now);
+		qsort(array, array_length, sizeof(struct mirror_st *),
+		    near_cmp);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		snprintf(trace_args, sizeof(trace_args), "\"mirrors\":%d",
+		    array_length);
+		trace_span(&trace, "filter, dedup and sort", 0, &span, &now,
+		    trace_args);
+	}
 
-		if (pledge("stdio", NULL) == -1) {
-			fprintf(stderr, "sed pledge 2 line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
+	/* the mirrors' hosts are all looked up at once, up front */
+	dns = NULL;
+	dns_len = 0;
+	if (!early && (!use_ftp || scan_keep > 0)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		dns = dns_prefetch(array, array_length, &dns_len, kq, s);
+		if (dns == NULL)
+			err(EXIT_FAILURE, "dns_prefetch line: %d", __LINE__);
+		clock_gettime(CLOCK_MONOTONIC, &timeout);
+		if (verbose >= 2) {
+			printf("looked up %d hosts in %f seconds.\n", dns_len,
+			    ts_elapsed(&now, &timeout));
 		}
-		fprintf(stderr, "sed execl line: %d\n", __LINE__);
-		_exit(EXIT_FAILURE);
+		snprintf(trace_args, sizeof(trace_args), "\"hosts\":%d",
+		    dns_len);
+		trace_span(&trace, "dns prefetch", 0, &now, &timeout,
+		    trace_args);
 	}
-	if (sed_pid == -1) {
-		n = errno;
-		kill(ftp_pid, SIGKILL);
-		errno = n;
-		err(EXIT_FAILURE, "sed fork line: %d", __LINE__);
+
+	/*
+	 * -P: a TCP handshake with every mirror at once weeds out the far
+	 * away ones before anything is downloaded
+	 */
+	if (scan_keep > 0 && scan_keep < array_length) {
+
+		n = array_length;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+		    rl.rlim_cur != RLIM_INFINITY) {
+			if (rl.rlim_cur <= 16)
+				n = 1;
+			else if ((rlim_t)n > rl.rlim_cur - 16)
+				n = rl.rlim_cur - 16;
+		}
+
+		if (verbose >= 2) {
+			printf("connecting to %d mirrors to keep the ",
+			    array_length);
+			printf("%d closest.\n", scan_keep);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &span);
+		n = connect_scan(array, array_length, scan_keep, n, kq, s,
+		    tls_cfg, dns, dns_len);
+		if (n == -1)
+			err(EXIT_FAILURE, "connect_scan line: %d", __LINE__);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		snprintf(trace_args, sizeof(trace_args),
+		    "\"mirrors\":%d,\"kept\":%d", array_length, n);
+		trace_span(&trace, "connect scan", 0, &span, &now, trace_args);
+		if (n == 0)
+			errx(EXIT_FAILURE, "No mirror could be connected to.");
+
+		if (verbose >= 2) {
+			for (c = 0; c < n; ++c) {
+				printf("%f : %s\n", array[c]->connect,
+				    array[c]->ftp_file);
+			}
+		}
+
+		array_length = n;
+		qsort(array, array_length, sizeof(struct mirror_st *),
+		    near_cmp);
 	}
 
-	close(ftp_to_sed[STDIN_FILENO]);
-	close(sed_to_parent[STDOUT_FILENO]);
+	/* -L, -g and -r still go over the network after the sweep */
+	if (use_ftp && pledge((get_file != NULL) ? "stdio proc exec cpath "
+	    "wpath inet dns" : (proxy_fd != -1 || rank_fd != -1) ?
+	    "stdio proc exec inet dns" : "stdio proc exec", NULL) == -1)
+		err(EXIT_FAILURE, "pledge line: %d", __LINE__);
 
+	/* -e readies each mirror as it comes in */
+	for (c = 0; c < array_length && !early; ++c) {
+		if (mirror_ready(array[c], &arena, samples) == -1)
+			err(EXIT_FAILURE, "arena_alloc line: %d", __LINE__);
+	}
 
-	struct utsname *name = malloc(sizeof(struct utsname));
-	if (name == NULL) {
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = ENOMEM;
-		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+	/*
+	 * -k: probe the mirrors which have been fastest lately first and
+	 * only go on to the rest if the best of them has fallen behind.
+	 */
+	probe_end = array_length;
+	hist_best = 0;
+	if (top_k) {
+		n = 0;
+		for (c = 0; c < array_length; ++c) {
+			h = array[c]->hist;
+			if (h->ok == 0 || h->fails > 0 ||
+			    hist_now - h->seen > HIST_FRESH)
+				continue;
+			m = array[n];
+			array[n++] = array[c];
+			array[c] = m;
+		}
+		if (n >= top_k) {
+			qsort(array, n, sizeof(struct mirror_st *),
+			    hist_ewma_cmp);
+			hist_best = array[0]->hist->ewma;
+			probe_end = top_k;
+			qsort(array + top_k, array_length - top_k,
+			    sizeof(struct mirror_st *), near_cmp);
+			if (verbose >= 2) {
+				printf("probing the %d fastest mirrors ", top_k);
+				printf("from %s first.\n", HIST_PATH);
+			}
+		} else {
+			qsort(array, array_length, sizeof(struct mirror_st *),
+			    near_cmp);
+			if (verbose >= 2) {
+				printf("%s doesn't know %d ", HIST_PATH, top_k);
+				printf("fast mirrors yet, probing them all.\n");
+			}
+		}
 	}
 	
-	if (uname(name) == -1) {
-		n = errno;
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = n;
-		err(EXIT_FAILURE, "uname line: %d", __LINE__);
+	best = -1;
+
+	/*
+	 * every probe in flight costs a process and, while it is being
+	 * started, a pipe. Keep -j inside of what the limits allow.
+	 */
+	if (getrlimit(RLIMIT_NPROC, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		if (rl.rlim_cur <= 16)
+			jobs = 1;
+		else if ((rlim_t)jobs > rl.rlim_cur - 16)
+			jobs = rl.rlim_cur - 16;
 	}
-	
-	char *release = malloc(4 + 1);
-	if (release == NULL) {
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = ENOMEM;
-		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		if (rl.rlim_cur <= 16)
+			jobs = 1;
+		else if ((rlim_t)jobs > (rl.rlim_cur - 16) / 2)
+			jobs = (rl.rlim_cur - 16) / 2;
 	}
-	strlcpy(release, name->release, 4 + 1);
+	if (jobs > array_length && !early)
+		jobs = array_length;
 
-	if (current == 0) {
-		tag_len = strlen("/") + strlen(release) + strlen("/") +
-		    strlen(name->machine) + strlen("/SHA256");
-	} else {
-		tag_len = strlen("/") + strlen("snapshots") + strlen("/") +
-		    strlen(name->machine) + strlen("/SHA256");
+	/* and what is left of the open files for kept-alive connections */
+	idle = 0;
+	idle_max = (early) ? INT_MAX : array_length;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		idle_max = rl.rlim_cur - 16 - 2 * jobs;
+
+	/*
+	 * running out of pipes or processes lowers jobs, which only holds
+	 * back new probes: those already in flight stay in their slots
+	 */
+	slot_max = jobs;
+	slot = calloc(slot_max, sizeof(struct probe_st));
+	if (slot == NULL) err(EXIT_FAILURE, "calloc line: %d", __LINE__);
+	for (k = 0; k < slot_max; ++k) {
+		slot[k].kind = UDATA_PROBE;
+		slot[k].pid = -1;
+		slot[k].http.fd = -1;
+		slot[k].http.dns_cache = dns;
+		slot[k].http.dns_cache_len = dns_len;
 	}
 
-	char *tag = malloc(tag_len + 1);
-	if (tag == NULL) {
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = ENOMEM;
-		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+	kev = calloc(slot_max, sizeof(struct event_st));
+	if (kev == NULL) err(EXIT_FAILURE, "calloc line: %d", __LINE__);
+
+	launched = finished = running = 0;
+	best_total = -1;
+	if (auto_jobs) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		aimd_init(&aimd, jobs, &now);
 	}
+	round = 1;
+	swept = array_length;
+
+	while (finished < probe_end || running > 0 || list_open) {
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (early)
+			dns_wait = pipe_dns(&pipeline, kq, &now, s);
+
+		if (auto_jobs && verbose >= 2 && aimd.level != aimd_shown) {
+			aimd_shown = aimd.level;
+			printf("\n-j auto: %d at once\n", aimd.level);
+		}
+
+		while (running < jobs && launched < probe_end &&
+		    (!auto_jobs || running < aimd.level)) {
+
+			/*
+			 * -e: a mirror whose host is being looked up waits,
+			 * and the nearest of the others goes first
+			 */
+			c = launched;
+			if (early) {
+				c = probe_end;
+				for (i = launched; i < probe_end; ++i) {
+					if (array[i]->lookup != NULL &&
+					    array[i]->lookup->q != NULL)
+						continue;
+					if (c == probe_end ||
+					    near_cmp(&array[i], &array[c]) < 0)
+						c = i;
+				}
+				if (c == probe_end)
+					break;
+			}
+			m = array[c];
+			array[c] = array[launched];
+			array[launched] = m;
+			c = launched;
+
+			n = strlcpy(line, array[c]->ftp_file, pos_max);
+			strlcpy(line + n, tag, pos_max - n);
+
+			for (k = 0; slot[k].busy; ++k)
+				;
+
+			if (use_ftp) {
+
+				if (pipe(block_pipe) == -1) {
+					if ((errno == EMFILE || errno == ENFILE)
+					    && running > 0) {
+						jobs = running;
+						break;
+					}
+					n = errno;
+					for (k = 0; k < slot_max; ++k) {
+						if (slot[k].pid != -1)
+							kill(slot[k].pid,
+							    SIGKILL);
+					}
+					errno = n;
+					err(EXIT_FAILURE, "pipe line: %d",
+					    __LINE__);
+				}
 
-	strlcpy(tag,           "/", tag_len + 1);	
+				clock_gettime(CLOCK_MONOTONIC, &span);
+				ftp_pid = fork();
+				if (ftp_pid == (pid_t) 0) {
 
-	if (current == 0)
-		strlcat(tag,     release, tag_len + 1);
-	else
-		strlcat(tag, "snapshots", tag_len + 1);
+					if (pledge("stdio exec", NULL) == -1) {
+						printf("ftp pledge 3 line: %d\n",
+						    __LINE__);
+						_exit(EXIT_FAILURE);
+					}
 
-	strlcat(tag,           "/", tag_len + 1);
-	strlcat(tag, name->machine, tag_len + 1);
-	strlcat(tag,     "/SHA256", tag_len + 1);
+					close(block_pipe[STDOUT_FILENO]);
+					read(block_pipe[STDIN_FILENO], &n,
+					    sizeof(int));
+					close(block_pipe[STDIN_FILENO]);
 
-	free(name);
+					if (verbose == 3) {
+						execl("/usr/bin/ftp", "ftp",
+						    "-vmo", "/dev/null", line,
+						    NULL);
+					} else {
+						i = open("/dev/null", O_WRONLY);
+						if (i != -1)
+							dup2(i, STDERR_FILENO);
+						execl("/usr/bin/ftp", "ftp",
+						    "-VMo", "/dev/null", line,
+						    NULL);
+					}
 
+					if (pledge("stdio", NULL) == -1) {
+						printf("ftp pledge 4 line: %d\n",
+						    __LINE__);
+						_exit(EXIT_FAILURE);
+					}
+					printf("ftp execl() failed line: %d\n",
+					    __LINE__);
+					_exit(EXIT_FAILURE);
+				}
+				if (ftp_pid == -1) {
+					n = errno;
+					close(block_pipe[STDIN_FILENO]);
+					close(block_pipe[STDOUT_FILENO]);
 
+					/* out of processes: wait for one */
+					if (n == EAGAIN && running > 0) {
+						jobs = running;
+						break;
+					}
+					for (k = 0; k < slot_max; ++k) {
+						if (slot[k].pid != -1)
+							kill(slot[k].pid,
+							    SIGKILL);
+					}
+					errno = n;
+					err(EXIT_FAILURE,
+					    "ftp 2 fork line: %d", __LINE__);
+				}
 
-	kq = kqueue();
-	if (kq == -1) {
-		n = errno;
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = n;
-		err(EXIT_FAILURE, "kq! line: %d", __LINE__);
-	}
-
-	EV_SET(&ke, sed_to_parent[STDIN_FILENO], EVFILT_READ,
-	    EV_ADD | EV_ONESHOT, 0, 0, NULL);
-	i = kevent(kq, &ke, 1, &ke, 1, &timeout0);
-	if (i == -1) {
-		n = errno;
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = n;
-		err(EXIT_FAILURE,
-		    "kevent, timeout0 may be too large. line: %d\n", __LINE__);
-	}
-	if (i == 0) {
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errx(EXIT_FAILURE,
-		    "timed out fetching: https://www.openbsd.org/ftp.html\n");
-	}
-	input = fdopen(sed_to_parent[STDIN_FILENO], "r");
-	if (input == NULL) {
-		n = errno;
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = n;
-		err(EXIT_FAILURE,
-		    "fdopen(sed_to_parent[STDIN_FILENO]...) line %d", __LINE__);
-	}
-
-	/* if the index for line[] exceeds 299, it will error out */
-	char *line = malloc(300);
-	if (line == NULL) {
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = ENOMEM;
-		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
-	}	
+				close(block_pipe[STDIN_FILENO]);
+				slot[k].pid = ftp_pid;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				trace_span(&trace, "fork ftp", k + 1, &span, &now,
+				    NULL);
+			}
 
-	array_max = 100;
-	array = calloc(array_max, sizeof(struct mirror_st *));
-	if (array == NULL) {
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = ENOMEM;
-		err(EXIT_FAILURE, "calloc line: %d", __LINE__);
-	}
+			slot[k].busy = 1;
+			slot[k].index = c;
+			slot[k].killed = 0;
 
+			/* with -j 1, show the mirror while it is probed */
+			if (verbose >= 2 && jobs == 1) {
+				if (verbose == 3)
+					printf("\n");
+				if (probe_end >= 100) {
+					printf("\n%3d : %s  :  %s\n",
+					    probe_end - c,
+					    array[c]->label, line);
+				} else {
+					printf("\n%2d : %s  :  %s\n",
+					    probe_end - c,
+					    array[c]->label, line);
+				}
+				fflush(stdout);
+			} else if (verbose == 0 || verbose == 1) {
+				/* with -e, more may have come in since */
+				if (c > 0) {
+					n = shown;
+					do {
+						printf("\b \b");
+						n /= 10;
+					} while (n > 0);
+				}
+				shown = probe_end - c;
+				printf("%d", shown);
+				fflush(stdout);
+			}
 
-	num = pos = array_length = 0;
-	array[0] = malloc(sizeof(struct mirror_st));
-	if (array[0] == NULL) {
-		kill(ftp_pid, SIGKILL);
-		kill(sed_pid, SIGKILL);
-		errno = ENOMEM;
-		err(EXIT_FAILURE, "malloc line: %d", __LINE__);
-	}
+			++launched;
+			++running;
 
-	int pos_max = 0;
-	
-	while ((c = getc(input)) != EOF) {
-		if (pos >= 300) {
-			kill(ftp_pid, SIGKILL);
-			kill(sed_pid, SIGKILL);
-			errx(EXIT_FAILURE,
-			    "pos got too big! line: %d", __LINE__);
-		}
-		if (num == 0) {
-			if (c != '\n') {
-				line[pos++] = c;
-				continue;
-			}
-			line[pos++] = '\0';
-			if (u) {
-				if (!strncmp("USA", line, 3)) {
-					while ((c = getc(input)) != EOF) {
-						if (c == '\n')
-							break;
+			if (use_ftp) {
+				n = ev_add(kq, ftp_pid, EVENT_EXIT, &slot[k]);
+			} else {
+				/* name lookup is part of the measurement */
+				slot[k].http.extra = (tourney && round == 1) ?
+				    TOURNEY_RANGE : range;
+				slot[k].http.cap = (range != NULL) ? cap : 0;
+				slot[k].http.keep = (samples > 1 ||
+				    targets > 1);
+				if (early) {
+					slot[k].http.dns_cache =
+					    array[c]->lookup;
+					slot[k].http.dns_cache_len =
+					    (array[c]->lookup != NULL);
+				}
+				clock_gettime(CLOCK_MONOTONIC, &slot[k].start);
+				if (array[c]->idle_fd != -1) {
+					n = http_reuse(&slot[k].http, line,
+					    tls_cfg, array[c]->idle_fd,
+					    array[c]->idle_tls);
+					array[c]->idle_fd = -1;
+					array[c]->idle_tls = NULL;
+					--idle;
+				} else
+					n = http_get(&slot[k].http, line,
+					    tls_cfg);
+				if (n == -1) {
+					http_close(&slot[k].http);
+					slot[k].busy = 0;
+					--running;
+					++finished;
+					array[c]->diff = s + 1;
+					array[c]->result = RESULT_ERROR;
+					array[c]->sample[
+					    array[c]->sample_len++] = s + 1;
+					hist_update(array[c]->hist, -1,
+					    hist_now);
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					trace_probe(&trace, &slot[k], k + 1,
+					    array[c]->ftp_file, round, "error",
+					    &now, use_ftp);
+					if (auto_jobs)
+						aimd_done(&aimd, 0, -1, &now);
+					if (verbose >= 2 && jobs > 1) {
+						printf("\n%*d : %s  :  %s\n",
+						    (probe_end >= 100) ?
+						    3 : 2,
+						    probe_end - finished + 1,
+						    array[c]->label, line);
 					}
-					if (c == EOF)
-						break;
-					pos = 0;
+					if (verbose >= 2)
+						printf("Download Error\n");
 					continue;
 				}
+				n = ev_add(kq, slot[k].http.fd, EVENT_WRITE,
+				    &slot[k]);
 			}
-			array[array_length]->label = malloc(pos);
-			if (array[array_length]->label == NULL) {
-				kill(ftp_pid, SIGKILL);
-				kill(sed_pid, SIGKILL);
-				errno = ENOMEM;
+			if (n == -1) {
+				n = errno;
+				for (k = 0; k < slot_max; ++k) {
+					if (slot[k].pid != -1)
+						kill(slot[k].pid, SIGKILL);
+				}
+				errno = n;
 				err(EXIT_FAILURE,
-				    "malloc line: %d", __LINE__);
+				    "ev_add line: %d", __LINE__);
 			}
-			strlcpy(array[array_length]->label, line, pos);
 
-			pos = 0;
-			num = 1;
-		} else {
-			if (pos == 0) {
-				if ((c != 'h') && (c != 'f') && (c != 'r'))
-					continue;
-				else if (insecure) {
-					if (c == 'r')
-						break;
-					if (c == 'f') {
-						line[pos++] = 'h';
-						c = 't';
-					}
-				} else if (c != 'h')
-					break;
+			if (use_ftp) {
+				clock_gettime(CLOCK_MONOTONIC, &slot[k].start);
+				close(block_pipe[STDOUT_FILENO]);
 			}
-			if (c != '\n') {
-				line[pos++] = c;
+		}
+
+		/*
+		 * wait no longer than the probe closest to timing out, or
+		 * to falling behind the fastest mirror so far
+		 */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		limit = (best != -1 && samples == 1) ? best * (1 + margin) : -1;
+		diff = -1;
+
+		/* -e: nor than a lookup or the list may go on */
+		if (list_open) {
+			elapsed = timeout0.tv_sec -
+			    ts_elapsed(&list_seen, &now);
+			diff = (elapsed < 0) ? 0 : elapsed;
+		}
+		if (early && dns_wait != -1 && (diff == -1 || dns_wait < diff))
+			diff = dns_wait;
+		for (k = 0; k < slot_max; ++k) {
+			if (!slot[k].busy || slot[k].killed)
 				continue;
+			elapsed = s - ts_elapsed(&slot[k].start, &now);
+			if (limit != -1) {
+				spent = probe_spent(&slot[k], metric, &now,
+				    &growing);
+				if (growing && limit - spent < elapsed)
+					elapsed = limit - spent;
 			}
-			
-			/* pos > 0 to get here */
-			/* excise the final unnecessary '/' in line[] */
-			line[pos - 1] = '\0';
+			if (elapsed < 0)
+				elapsed = 0;
+			if (diff == -1 || elapsed < diff)
+				diff = elapsed;
+		}
+		if (diff != -1) {
+			timeout.tv_sec = (time_t) diff;
+			timeout.tv_nsec =
+			    (long) ((diff - (double) timeout.tv_sec) *
+			    1000000000.0);
+		}
+
+		i = ev_wait(kq, kev, slot_max,
+		    (diff != -1) ? &timeout : NULL);
+		if (i == -1) {
+			n = errno;
+			for (k = 0; k < slot_max; ++k) {
+				if (slot[k].pid != -1)
+					kill(slot[k].pid, SIGKILL);
+			}
+			errno = n;
+			err(EXIT_FAILURE, "ev_wait line: %d", __LINE__);
+		}
 
-			if (pos_max < pos)
-				pos_max = pos;
+		clock_gettime(CLOCK_MONOTONIC, &now);
 
-			if (!insecure) {
-				if (strncmp(line, "https", 5))
-					break;
-			} else if (!strncmp(line, "https", 5)) {
-				free(array[array_length]->label);
-				num = pos = 0;
+		for (k = 0; k < i; ++k) {
+
+			struct probe_st *p = kev[k].udata;
+
+			/* -e: the list and the lookups share the queue */
+			if (p == fetch) {
+				list_seen = now;
+				n = http_step(&fetch->http);
+				if (list.stop || list.error ||
+				    (n != HTTP_WANT_READ &&
+				    n != HTTP_WANT_WRITE))
+					list_over = 1;
+				else if (ev_add(kq, fetch->http.fd,
+				    (n == HTTP_WANT_READ) ? EVENT_READ :
+				    EVENT_WRITE, fetch) == -1)
+					err(EXIT_FAILURE, "ev_add line: %d",
+					    __LINE__);
 				continue;
 			}
-			
+			if (early && *(int8_t *)kev[k].udata == UDATA_DNS) {
+				struct dns_st *d = kev[k].udata;
 
-			array[array_length]->ftp_file = malloc(pos);
-			    
-			if (array[array_length]->ftp_file == NULL) {
-				kill(ftp_pid, SIGKILL);
-				kill(sed_pid, SIGKILL);
-				errno = ENOMEM;
-				err(EXIT_FAILURE,
-				    "malloc line: %d", __LINE__);
+				if (d->q != NULL)
+					dns_step(d, kq, &now);
+				continue;
 			}
-			
-			strlcpy(array[array_length]->ftp_file, line, pos);
 
-			if (++array_length >= array_max) {
-				array_max += 20;
-				array = reallocarray(array, array_max,
-				    sizeof(struct mirror_st *));
+			if (kev[k].filter == EVENT_EXIT) {
+				waitpid(p->pid, &n, 0);
+				p->pid = -1;
+			} else {
+				n = http_step(&p->http);
+				if (n == HTTP_WANT_READ ||
+				    n == HTTP_WANT_WRITE) {
+					if (ev_add(kq, p->http.fd,
+					    (n == HTTP_WANT_READ) ? EVENT_READ :
+					    EVENT_WRITE, p) == -1) {
+						err(EXIT_FAILURE,
+						    "ev_add line: %d",
+						    __LINE__);
+					}
+					continue;
+				}
+				n = (p->http.state != HTTP_DONE ||
+				    (p->http.status != 200 &&
+				    p->http.status != 206));
 
-				if (array == NULL) {
-					kill(ftp_pid, SIGKILL);
-					kill(sed_pid, SIGKILL);
-					errno = ENOMEM;
-					err(EXIT_FAILURE,
-					    "reallocarray line: %d", __LINE__);
+				/* the next round's probe of it goes over this */
+				if (n == 0 && p->http.reusable &&
+				    p->http.redirects == 0 && idle < idle_max) {
+					array[p->index]->idle_fd = p->http.fd;
+					array[p->index]->idle_tls = p->http.tls;
+					p->http.fd = -1;
+					p->http.tls = NULL;
+					++idle;
 				}
+				http_close(&p->http);
 			}
-			array[array_length] = malloc(sizeof(struct mirror_st));
+			p->busy = 0;
+			--running;
 
-			if (array[array_length] == NULL) {
-				kill(ftp_pid, SIGKILL);
-				kill(sed_pid, SIGKILL);
-				errno = ENOMEM;
-				err(EXIT_FAILURE, "malloc line: %d", __LINE__);
-			}
-			pos = num = 0;
-		}
-	}
-	fclose(input);
-	free(line);
+			/* already recorded as a timeout */
+			if (p->killed)
+				continue;
 
-	pos_max += tag_len;
-	line = malloc(pos_max);
-	if (line == NULL) err(EXIT_FAILURE, "malloc line: %d", __LINE__);
+			++finished;
+			c = p->index;
 
-	close(sed_to_parent[STDIN_FILENO]);
+			trace_probe(&trace, p, p - slot + 1, array[c]->ftp_file,
+			    round, (n != 0) ? "error" :
+			    (ts_elapsed(&p->start, &now) >= s) ? "timeout" : "ok",
+			    &now, use_ftp);
 
-	kill(ftp_pid, SIGKILL);
-	kill(sed_pid, SIGKILL);
-	waitpid(ftp_pid, NULL, 0);
-	waitpid(sed_pid, NULL, 0);
+			if (verbose >= 2 && jobs > 1) {
+				printf("\n%*d : %s  :  %s%s\n",
+				    (probe_end >= 100) ? 3 : 2,
+				    probe_end - finished + 1,
+				    array[c]->label, array[c]->ftp_file, tag);
+			}
 
-	if (array_length == 0)
-		errx(EXIT_FAILURE, "No mirror found. Is www.openbsd.org live?");
+			if (n != 0) {
+				array[c]->diff = s + 1;
+				array[c]->result = RESULT_ERROR;
+				array[c]->sample[array[c]->sample_len++] = s + 1;
+				hist_update(array[c]->hist, -1, hist_now);
+				if (verbose >= 2)
+					printf("Download Error\n");
+				if (auto_jobs)
+					aimd_done(&aimd, p->http.got, -1, &now);
+				continue;
+			}
 
-	if (num == 1)
-		free(array[array_length]->label);
-	free(array[array_length]);
+			/* the whole probe decides a timeout, not the metric */
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = ts_elapsed(&p->start, &now);
 
-	
-	if (insecure) {
-		
-		qsort(array, array_length, sizeof(struct mirror_st *), ftp_cmp);
-		c = 1;
-		while (c < array_length) {
-			if (!strcmp(array[c - 1]->ftp_file,
-			    array[c]->ftp_file)) {
-				free(array[c - 1]->label);
-				free(array[c - 1]->ftp_file);
-				free(array[c - 1]);
-				for (i = c; i < array_length; ++i)
-					array[i - 1] = array[i];
-				--array_length;
-			} else
-				++c;
-		}
-	}
-
-	array = reallocarray(array, array_length, sizeof(struct mirror_st *));
-	if (array == NULL) err(EXIT_FAILURE, "reallocarray line: %d", __LINE__);
-		
-	qsort(array, array_length, sizeof(struct mirror_st *), label_cmp);
-	
-	S = s;
+			/*
+			 * -j auto: how much slower than usual it was, before
+			 * this probe goes into its moving average
+			 */
+			if (auto_jobs) {
+				aimd_done(&aimd, p->http.got, (elapsed < s &&
+				    array[c]->hist->ok > 0 &&
+				    array[c]->hist->ewma > 0) ?
+				    elapsed / array[c]->hist->ewma : -1, &now);
+			}
 
-	timeout.tv_sec = (time_t) s;
-	timeout.tv_nsec =
-	    (long) ((s - (double) timeout.tv_sec) * 1000000000.0);
+			if (!use_ftp) {
+				array[c]->dns = p->http.dns +
+				    p->http.dns_cached;
+				array[c]->connect = p->http.connect;
+				array[c]->handshake = p->http.handshake;
+				array[c]->ttfb = p->http.ttfb;
+				array[c]->xfer = elapsed - p->http.dns -
+				    p->http.connect - p->http.handshake -
+				    p->http.ttfb;
+				array[c]->rate = (array[c]->xfer > 0) ?
+				    p->http.got / array[c]->xfer : 0;
+			}
 
-	for (c = 0; c < array_length; ++c) {
+			/*
+			 * -b: what the range should have brought, as the 206
+			 * says how large the file is. A body cut short of it
+			 * fails, as a short body would seem to arrive sooner.
+			 */
+			want = p->http.got;
+			if (!use_ftp && p->http.cap > 0 &&
+			    p->http.range_total != -1) {
+				want = p->http.range_total - p->http.range_off;
+				if (want > p->http.cap)
+					want = p->http.cap;
+			}
+			if (elapsed < s && p->http.got < want) {
+				array[c]->diff = s + 1;
+				array[c]->result = RESULT_ERROR;
+				array[c]->sample[array[c]->sample_len++] = s + 1;
+				hist_update(array[c]->hist, -1, hist_now);
+				if (verbose >= 2)
+					printf("Short Read\n");
+				continue;
+			}
 
-		n = strlcpy(line, array[c]->ftp_file, pos_max);
-		strlcpy(line + n, tag, pos_max - n);
+			hist_update(array[c]->hist,
+			    (elapsed < s) ? elapsed : -1, hist_now);
+			if (elapsed < s &&
+			    (best_total == -1 || elapsed < best_total))
+				best_total = elapsed;
 
-		if (verbose >= 2) {
-			if (verbose == 3)
-				printf("\n");
-			if (array_length >= 100) {
-				printf("\n%3d : %s  :  %s\n", array_length - c,
-				    array[c]->label, line);
-			} else {
-				printf("\n%2d : %s  :  %s\n", array_length - c,
-				    array[c]->label, line);
+			if (metric == METRIC_TTFB ||
+			    (tourney && round == 1 && !use_ftp))
+				array[c]->diff = array[c]->ttfb;
+			else if (metric == METRIC_CONNECT)
+				array[c]->diff = array[c]->connect;
+			else if (metric == METRIC_RATE) {
+				/*
+				 * the time 'want' takes at the mirror's rate,
+				 * so the fastest rate ranks first
+				 */
+				array[c]->diff = (array[c]->rate > 0) ?
+				    want / array[c]->rate : array[c]->xfer;
 			}
-		} else if (verbose >= 0) {
-			i = array_length - c;
-			if (c > 0) {
-				if ((i == 9) || (i == 99))
-					printf("\b \b");
-				n = i;
-				do {
-					printf("\b");
-					n /= 10;
-				} while (n > 0);
-			}
-			printf("%d", i);
-			fflush(stdout);
-		}
+			else
+				array[c]->diff = elapsed;
 
-		if (pipe(block_pipe) == -1)
-			err(EXIT_FAILURE, "pipe line: %d", __LINE__);
+			if (!use_ftp && elapsed < s && p->http.reused) {
+				array[c]->warm += array[c]->diff;
+				++array[c]->warm_len;
+			} else if (!use_ftp && elapsed < s)
+				array[c]->cold = p->http.connect +
+				    p->http.handshake;
 
-		ftp_pid = fork();
-		if (ftp_pid == (pid_t) 0) {
+			array[c]->result = (elapsed >= s) ?
+			    RESULT_TIMEOUT : RESULT_OK;
+			if (elapsed < s && (best == -1 || array[c]->diff < best))
+				best = array[c]->diff;
 
-			if (pledge("stdio exec", NULL) == -1) {
-				printf("ftp pledge 3 line: %d\n", __LINE__);
-				_exit(EXIT_FAILURE);
+			if (verbose >= 2) {
+				if (elapsed >= s) {
+					array[c]->diff = s;
+					printf("Timeout\n");
+				} else {
+					printf("%f", array[c]->diff);
+					if (!use_ftp && p->http.reused) {
+						printf("  (kept alive  "
+						    "ttfb %f  transfer %f)",
+						    array[c]->ttfb,
+						    array[c]->xfer);
+					} else if (!use_ftp) {
+						printf("  (dns %f  connect %f  "
+						    "tls %f  ttfb %f  "
+						    "transfer %f)",
+						    array[c]->dns,
+						    array[c]->connect,
+						    array[c]->handshake,
+						    array[c]->ttfb,
+						    array[c]->xfer);
+					}
+					if (metric == METRIC_RATE) {
+						printf("  %.1f KB/s",
+						    array[c]->rate / 1024);
+					}
+					printf("\n");
+				}
+			} else if (elapsed >= s)
+				array[c]->diff = s;
+			array[c]->sample[array[c]->sample_len++] =
+			    array[c]->diff;
+		}
+
+		/*
+		 * -e: the mirrors which came in are added, and once the page
+		 * is over or has stalled, the rest of it or the cached list
+		 */
+		if (list_open) {
+			if (!list_over &&
+			    ts_elapsed(&list_seen, &now) >= timeout0.tv_sec)
+				list_fail = list_over = 1;
+			if (list_over) {
+				if (list_settle(&list, &cache, &fetch->http,
+				    list_url, list_fail, cached, NULL,
+				    verbose, (f && list_keep) ? to_write :
+				    NULL, &trace, &list_start) == 1)
+					pipeline.taken = 0;
+				list_open = 0;
 			}
-			
-			close(block_pipe[STDOUT_FILENO]);
-			read(block_pipe[STDIN_FILENO], &n, sizeof(int));
-			close(block_pipe[STDIN_FILENO]);
+			if (pipe_take(&pipeline, &list, kq) == -1) {
+				errno = ENOMEM;
+				err(EXIT_FAILURE, "pipe_take line: %d",
+				    __LINE__);
+			}
+			if (!list_open)
+				list_free(&list);
+			array = pipeline.array;
+			array_length = probe_end = pipeline.length;
+			if (array_length == 0 && !list_open) {
+				errx(EXIT_FAILURE, "No mirror found. "
+				    "Is www.openbsd.org live?");
+			}
+			if (pos_max < pipeline.url_max + tag_len) {
+				pos_max = pipeline.url_max + tag_len;
+				free(line);
+				line = malloc(pos_max);
+				if (line == NULL)
+					err(EXIT_FAILURE, "malloc line: %d",
+					    __LINE__);
+			}
+		}
+
+		/*
+		 * timeout occured before the probe finished, or it can no
+		 * longer beat the fastest mirror by the -c margin
+		 */
+		limit = (best != -1 && samples == 1) ? best * (1 + margin) : -1;
+		for (k = 0; k < slot_max; ++k) {
+			if (!slot[k].busy || slot[k].killed)
+				continue;
+			elapsed = ts_elapsed(&slot[k].start, &now);
+			if (elapsed >= s)
+				n = RESULT_TIMEOUT;
+			else if (limit != -1 && probe_spent(&slot[k], metric,
+			    &now, &growing) >= limit)
+				n = RESULT_CUTOFF;
+			else
+				continue;
 
-			if (verbose == 3) {
-				execl("/usr/bin/ftp", "ftp", "-vmo",
-				    "/dev/null", line, NULL);
+			if (use_ftp) {
+				/* its exit event is reaped by ev_wait() */
+				kill(slot[k].pid, SIGKILL);
+				slot[k].killed = 1;
 			} else {
-				i = open("/dev/null", O_WRONLY);
-				if (i != -1)
-					dup2(i, STDERR_FILENO);
-				execl("/usr/bin/ftp", "ftp", "-VMo",
-				    "/dev/null", line, NULL);
+				/* closing the socket drops its event */
+				http_close(&slot[k].http);
+				slot[k].busy = 0;
+				--running;
 			}
 
-			if (pledge("stdio", NULL) == -1) {
-				printf("ftp pledge 4 line: %d\n", __LINE__);
-				_exit(EXIT_FAILURE);
+			++finished;
+			c = slot[k].index;
+			trace_probe(&trace, &slot[k], k + 1, array[c]->ftp_file,
+			    round, (n == RESULT_CUTOFF) ? "cut off" : "timeout",
+			    &now, use_ftp);
+			/*
+			 * a cut off mirror ranks after the timeouts, apart
+			 * from them, and before the download errors
+			 */
+			array[c]->diff = (n == RESULT_CUTOFF) ? s + 0.5 : s;
+			array[c]->result = n;
+			array[c]->cut = elapsed;
+			array[c]->sample[array[c]->sample_len++] =
+			    array[c]->diff;
+
+			/* cut short by a faster mirror isn't a failure */
+			if (n == RESULT_TIMEOUT)
+				hist_update(array[c]->hist, -1, hist_now);
+			if (auto_jobs)
+				aimd_done(&aimd, slot[k].http.got, -1, &now);
+
+			if (verbose >= 2 && jobs > 1) {
+				printf("\n%*d : %s  :  %s%s\n",
+				    (probe_end >= 100) ? 3 : 2,
+				    probe_end - finished + 1,
+				    array[c]->label, array[c]->ftp_file, tag);
+			}
+			if (verbose >= 2 && n == RESULT_CUTOFF)
+				printf("Cut off after %f\n", elapsed);
+			else if (verbose >= 2)
+				printf("Timeout\n");
+		}
+
+		/* the history doesn't agree with what was measured */
+		if (round == 1 && finished == probe_end && running == 0 &&
+		    probe_end < array_length && (best_total == -1 ||
+		    best_total > HIST_SLACK * hist_best)) {
+			if (verbose >= 2) {
+				printf("\nthe fastest mirrors have slowed ");
+				printf("down, probing the rest.\n");
 			}
-			printf("ftp execl() failed line: %d\n", __LINE__);
-			_exit(EXIT_FAILURE);
+			probe_end = array_length;
 		}
-		if (ftp_pid == -1)
-			err(EXIT_FAILURE, "ftp 2 fork line: %d", __LINE__);
 
+		if (finished < probe_end || running > 0 || list_open)
+			continue;
+		for (c = 0; c < probe_end; ++c)
+			array[c]->round = round;
+		if (round == 1)
+			swept = probe_end;
+		if (++round > samples)
+			break;
 
-		close(block_pipe[STDIN_FILENO]);
+		if (tourney) {
 
-		EV_SET(&ke, ftp_pid, EVFILT_PROC, EV_ADD | EV_ONESHOT,
-		    NOTE_EXIT, 0, NULL);
-		if (kevent(kq, &ke, 1, NULL, 0, NULL) == -1) {
-			n = errno;
-			kill(ftp_pid, SIGKILL);
-			errno = n;
-			err(EXIT_FAILURE,
-			    "kevent register fail line: %d", __LINE__);
-		}
-		gettimeofday(&tv_start, NULL);
+			/*
+			 * -T: the faster half of the mirrors which answered
+			 * go on to the next round.
+			 */
+			for (c = 0; c < probe_end; ++c) {
+				array[c]->diff = sample_stat(array[c],
+				    quantile, &lo, &hi);
+				if (array[c]->diff >= s)
+					array[c]->round = 0;
+			}
+			qsort(array, probe_end, sizeof(struct mirror_st *),
+			    diff_cmp);
+			for (alive = 0; alive < probe_end &&
+			    array[alive]->diff < s; ++alive)
+				;
+			alive = (alive + 1) / 2;
+			if (alive <= 1)
+				break;
 
-		close(block_pipe[STDOUT_FILENO]);
+			/* the first round only timed the first byte */
+			if (round == 2) {
+				for (c = 0; c < alive; ++c) {
+					array[c]->sample_len = 0;
+					array[c]->warm = 0;
+					array[c]->warm_len = 0;
+				}
+			}
+			for (c = alive; c < probe_end; ++c)
+				idle -= idle_close(array[c]);
 
+			if (verbose >= 2) {
+				printf("\n\nround %d: the fastest %d ",
+				    round, alive);
+				printf("mirrors go on.\n");
+			} else if (verbose == 0 || verbose == 1) {
+				printf("\b \b");
+				fflush(stdout);
+			}
+			probe_end = alive;
+			launched = finished = 0;
+			continue;
+		}
 
-		i = kevent(kq, NULL, 0, &ke, 1, &timeout);
-		if (i == -1) {
-			n = errno;
-			kill(ftp_pid, SIGKILL);
-			errno = n;
-			err(EXIT_FAILURE, "kevent line: %d", __LINE__);
+		/*
+		 * -n: once there are two samples of each, the mirrors whose
+		 * confidence interval lies wholly above the leader's are out
+		 * of contention.
+		 */
+		best_hi = -1;
+		diff = -1;
+		for (c = 0; c < probe_end; ++c) {
+			elapsed = sample_stat(array[c], quantile, &lo, &hi);
+			if (elapsed < s && (diff == -1 || elapsed < diff)) {
+				diff = elapsed;
+				best_hi = hi;
+			}
 		}
-		
-		/* timeout occured before ftp() exit received */
-		if (i == 0) {
-			kill(ftp_pid, SIGKILL);
-			
-			/* reap event */
-			if (kevent(kq, NULL, 0, &ke, 1, NULL) == -1)
-				err(EXIT_FAILURE, "kevent line: %d", __LINE__);
-			waitpid(ftp_pid, NULL, 0);
-			if (verbose >= 2)
-				printf("Timeout\n");
-			array[c]->diff = s;
-			continue;
+		alive = 0;
+		for (c = 0; c < probe_end; ++c) {
+			sample_stat(array[c], quantile, &lo, &hi);
+			if (round > 2 && best_hi != -1 && lo > best_hi)
+				continue;
+			m = array[alive];
+			array[alive++] = array[c];
+			array[c] = m;
 		}
-		
-		waitpid(ftp_pid, &n, 0);
-		
-		if (n != 0) {
-			array[c]->diff = s + 1;
-			if (verbose >= 2)
-				printf("Download Error\n");
-			continue;
+		if (best_hi == -1 || alive <= 1)
+			break;
+		for (c = alive; c < probe_end; ++c)
+			idle -= idle_close(array[c]);
+
+		if (verbose >= 2) {
+			printf("\n\nsample %d of %d: %d mirrors ", round,
+			    samples, alive);
+			printf("are still in contention.\n");
+		} else if (verbose == 0 || verbose == 1) {
+			printf("\b \b");
+			fflush(stdout);
 		}
+		probe_end = alive;
+		launched = finished = 0;
+	}
 
-		gettimeofday(&tv_end, NULL);
+	/* -e: the lookups are kept for later probes, as dns_prefetch()'s */
+	if (early) {
+		dns = pipe_end(&pipeline, &dns_len);
+		if (dns == NULL)
+			err(EXIT_FAILURE, "pipe_end line: %d", __LINE__);
+		hist = hist_attach(hist, hist_length, &hist_total, array,
+		    array_length);
+		if (hist == NULL)
+			err(EXIT_FAILURE, "hist_attach line: %d", __LINE__);
+	}
+	free(extra);
+	free(etag);
+	free(modified);
+	free(fetch);
 
-		array[c]->diff =
-		    (double)(tv_end.tv_sec - tv_start.tv_sec) +
-		    (double)(tv_end.tv_usec - tv_start.tv_usec) /
-		    1000000.0;
-			
-		if (verbose >= 2) {
-			if (array[c]->diff >= s) {
-				array[c]->diff = s;
-				printf("Timeout\n");
-			} else
-				printf("%f\n", array[c]->diff);
-		} else if (verbose <= 0 && array[c]->diff < S) {
-			S = array[c]->diff;
-			timeout.tv_sec = (time_t) S;
-			timeout.tv_nsec =
-			    (long) ((S - (double) timeout.tv_sec)
-			    * 1000000000.0);
-		} else if (array[c]->diff > s)
-			array[c]->diff = s;
+	/* -n and -T rank on a statistic of the samples */
+	for (c = 0; c < swept; ++c) {
+		array[c]->diff = sample_stat(array[c], quantile, &lo, &hi);
+		if (array[c]->diff >= s)
+			array[c]->round = 0;
+		if (targets < 2)
+			idle -= idle_close(array[c]);
+	}
+
+	/* what -k didn't get to */
+	array_length = swept;
+
+	for (k = 0; k < slot_max; ++k) {
+		free(slot[k].http.url);
+		free(slot[k].http.path);
+	}
+	free(kev);
+	free(slot);
+
+	/* -j auto: the other targets go at the level it settled on */
+	if (auto_jobs)
+		jobs = aimd.good;
+
+	/*
+	 * -t: the other targets are probed, -j mirrors at a time, on every
+	 * mirror which was swept, as one which failed for the first may
+	 * well have the others, over the names and connections it left.
+	 * They are ranked on their total time.
+	 */
+	if (targets > 1) {
+		order = calloc(array_length, sizeof(struct mirror_st *));
+		ranked = calloc(array_length, sizeof(struct mirror_st *));
+		saved = calloc(array_length, sizeof(double));
+		if (order == NULL || ranked == NULL || saved == NULL)
+			err(EXIT_FAILURE, "calloc line: %d", __LINE__);
+		memcpy(order, array, array_length *
+		    sizeof(struct mirror_st *));
+		qsort(order, array_length, sizeof(struct mirror_st *),
+		    diff_cmp);
+		n = array_length;
+		for (c = 0; c < n; ++c)
+			saved[c] = order[c]->diff;
+
+		target_out = open_memstream(&target_buf, &target_len);
+		if (target_out == NULL)
+			err(EXIT_FAILURE, "open_memstream line: %d", __LINE__);
+		for (i = 1; i < targets; ++i) {
+			if (asprintf(&target_tag, "/%s/%s", target[i],
+			    probe_file) == -1)
+				err(EXIT_FAILURE, "asprintf line: %d", __LINE__);
+			clock_gettime(CLOCK_MONOTONIC, &span);
+			for (c = 0; c < n; c += jobs) {
+				if (probe_batch(order + c, (n - c < jobs) ?
+				    n - c : jobs, kq, s, tls_cfg, target_tag,
+				    range, cap, dns, dns_len, 1) == -1)
+					err(EXIT_FAILURE, "probe_batch line: %d",
+					    __LINE__);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			trace_span(&trace, target[i], 0, &span, &now, NULL);
+			free(target_tag);
+
+			memcpy(ranked, order, n * sizeof(struct mirror_st *));
+			qsort(ranked, n, sizeof(struct mirror_st *),
+			    target_cmp);
+			if (rank_fd != -1 && n > 0 && ranked[0]->diff < s) {
+				rank_doc(&rank_buf[i], &rank_len[i], target[i],
+				    ranked, n, ranked[0], s, time(NULL));
+			}
+			fprintf(target_out, "\n%s:\n", target[i]);
+			for (c = 0; c < n && ranked[c]->diff < s; ++c) {
+				if (c > 0 && verbose < 1)
+					break;
+				fprintf(target_out, "%f : %s\n",
+				    ranked[c]->diff, ranked[c]->ftp_file);
+			}
+			if (c == 0)
+				fprintf(target_out, "No successful mirrors.\n");
+		}
+		if (fclose(target_out) == EOF)
+			err(EXIT_FAILURE, "fclose line: %d", __LINE__);
+
+		for (c = 0; c < n; ++c)
+			order[c]->diff = saved[c];
+		for (c = 0; c < array_length; ++c)
+			idle -= idle_close(array[c]);
+		free(saved);
+		free(ranked);
+		free(order);
 	}
 
+	if (dns != NULL)
+		dns_free(dns, dns_len);
 
-	if (pledge("stdio", NULL) == -1)
+
+	/*
+	 * -d goes on probing, -g and -L on fetching from the mirrors and
+	 * -r on serving the ranking
+	 */
+	if (pledge((get_file != NULL) ? "stdio cpath wpath inet dns" :
+	    (interval > 0 || proxy_fd != -1 || rank_fd != -1) ?
+	    "stdio inet dns" : "stdio", NULL) == -1)
 		err(EXIT_FAILURE, "pledge line: %d", __LINE__);
 
 	free(line);
-	free(tag);		
-	close(kq);
+	if (interval == 0)
+		free(tag);
+	if (interval == 0 && proxy_fd == -1 && get_file == NULL &&
+	    rank_fd == -1)
+		ev_close(kq);
 
 	if (verbose == 0 || verbose == 1) {
 		printf("\b \b");
@@ -926,11 +6778,17 @@ main(int argc, char *argv[])
 	if (verbose >= 1) {
 		
 		int ts = -1, te = -1,   ds = -1, de = -1,   se = -1;
+		int cs = -1, ce = -1;
 		
 		for (c = array_length - 1; c >= 0; --c) {
 			if (array[c]->diff < s) {
 				se = c;
 				break;
+			} else if (array[c]->result == RESULT_CUTOFF) {
+				if (cs == -1)
+					cs = ce = c;
+				else
+					cs = c;
 			} else if (array[c]->diff == s) {
 				if (ts == -1) 
 					ts = te = c;
@@ -949,6 +6807,11 @@ main(int argc, char *argv[])
 			    sizeof(struct mirror_st *), label_rev_cmp);
 		}
 		
+		if (ce > cs) {
+			qsort(array + cs, 1 + ce - cs,
+			    sizeof(struct mirror_st *), label_rev_cmp);
+		}
+		
 		if (de > ds) {
 			qsort(array + ds, 1 + de - ds,
 			    sizeof(struct mirror_st *), label_rev_cmp);
@@ -960,6 +6823,8 @@ main(int argc, char *argv[])
 			printf("\n\nSUCCESSFUL MIRRORS:\n\n\n");
 		else if (te == c)
 			printf("\n\nTIMEOUT MIRRORS:\n\n\n");
+		else if (ce == c)
+			printf("\n\nCUT OFF MIRRORS:\n\n\n");
 		else
 			printf("\n\nDOWNLOAD ERROR MIRRORS:\n\n\n");
 
@@ -974,17 +6839,52 @@ main(int argc, char *argv[])
 			printf("\"%s\" > /etc/installurl",
 			    array[c]->ftp_file);
 
-			if (c <= se)
-				printf(" : %f\n\n", array[c]->diff);
-			else if (c <= te) {
+			if (c <= se) {
+				printf(" : %f", array[c]->diff);
+				if (metric == METRIC_RATE) {
+					printf("  %.1f KB/s",
+					    array[c]->rate / 1024);
+				}
+				if (array[c]->sample_len > 1) {
+					sample_stat(array[c], quantile, &lo,
+					    &hi);
+					printf("  (%s of %d, 95%% CI %f - %f)",
+					    (quantile == 0.5) ? "median" : "p90",
+					    array[c]->sample_len, lo, hi);
+				}
+				if (array[c]->warm_len > 0) {
+					printf("\n\t(cold: connect and tls %f"
+					    "  warm: %f, mean of %d)",
+					    array[c]->cold, array[c]->warm /
+					    array[c]->warm_len,
+					    array[c]->warm_len);
+				}
+				if (verbose >= 2 && !use_ftp) {
+					printf("\n\t(dns %f  connect %f  "
+					    "tls %f  ttfb %f  transfer %f)",
+					    array[c]->dns, array[c]->connect,
+					    array[c]->handshake,
+					    array[c]->ttfb, array[c]->xfer);
+				}
+				printf("\n\n");
+			} else if (c <= te) {
 				//~ printf(" Timeout");
 				printf("\n\n");
 				if (c == ts && se != -1)
 					printf("\nSUCCESSFUL MIRRORS:\n\n\n");
+			} else if (c <= ce) {
+				printf(" : cut off after %f\n\n",
+				    array[c]->cut);
+				if (c == cs && ts != -1)
+					printf("\nTIMEOUT MIRRORS:\n\n\n");
+				else if (c == cs && se != -1)
+					printf("\nSUCCESSFUL MIRRORS:\n\n\n");
 			} else {
 				//~ printf(" Download Error");
 				printf("\n\n");
-				if (c == ds && ts != -1)
+				if (c == ds && cs != -1)
+					printf("\nCUT OFF MIRRORS:\n\n\n");
+				else if (c == ds && ts != -1)
 					printf("\nTIMEOUT MIRRORS:\n\n\n");
 				else if (c == ds && se != -1)
 					printf("\nSUCCESSFUL MIRRORS:\n\n\n");
@@ -992,6 +6892,26 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (auto_jobs && verbose >= 1) {
+		printf("-j auto settled on %d at once, ", aimd.good);
+		printf("pin it with \"-j %d\".\n", aimd.good);
+	}
+
+	/* -t: the fastest for each of the other targets, all of them at -v */
+	if (target_buf != NULL) {
+		if (verbose >= 0) {
+			if (verbose >= 1)
+				printf("\nOTHER TARGETS:\n");
+			fputs(target_buf, stdout);
+			printf("\n");
+		}
+		free(target_buf);
+	}
+
+	/* failures are worth remembering too, so this is sent first */
+	if (f)
+		hist_send(to_write, hist, hist_total, hist_now);
+
 	if (array[0]->diff >= s) {
 		if (current == 0 && override == 1) {
 			printf("\n\nNo mirrors. It doesn't appear that the ");
@@ -1001,33 +6921,259 @@ main(int argc, char *argv[])
 			errx(EXIT_FAILURE, "No successful mirrors found.");
 	}
 	
-	if (f) {
-		if (dup2(parent_to_write[STDOUT_FILENO], STDOUT_FILENO) == -1) {
-			printf("dup2 line: %d\n", __LINE__);
-			
-			if (verbose < 0)
-				return EXIT_FAILURE;
-			
-			printf("As root, type:\n");
-			printf("echo \"%s\" > /etc/installurl\n",
-			    array[0]->ftp_file);
-			return EXIT_FAILURE;
+	/*
+	 * -g: the file is checked against its SHA256 file, which is only
+	 * as trustworthy as the mirrors unless it is verified with signify
+	 */
+	if (get_file != NULL) {
+		if (fetch_sum(array, array_length, kq, s, tls_cfg, get_sums,
+		    get_name, get_hex) == -1)
+			errx(EXIT_FAILURE, "couldn't find %s in %s", get_name,
+			    get_sums);
+		get_fd = open(get_tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0644);
+		if (get_fd == -1)
+			err(EXIT_FAILURE, "open %s", get_tmp);
+		clock_gettime(CLOCK_MONOTONIC, &span);
+		get_size = fetch_run(array, array_length, kq, s, tls_cfg,
+		    get_path, get_fd, verbose);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		snprintf(trace_args, sizeof(trace_args), "\"bytes\":%lld",
+		    get_size);
+		trace_span(&trace, get_path, 0, &span, &now, trace_args);
+		if (get_size == -1) {
+			unlink(get_tmp);
+			errx(EXIT_FAILURE, "couldn't fetch %s", get_path);
 		}
-		
-		/* remove superfluous dynamic array memory before writing */
-		for (c = 1; c < array_length; ++c) {
-			free(array[c]->ftp_file);
-			free(array[c]->label);
-			free(array[c]);
+		if (fetch_hash(get_fd, get_size, got_hex) == -1) {
+			unlink(get_tmp);
+			err(EXIT_FAILURE, "pread line: %d", __LINE__);
+		}
+		if (strcmp(get_hex, got_hex)) {
+			unlink(get_tmp);
+			errx(EXIT_FAILURE, "%s doesn't match its SHA256",
+			    get_name);
+		}
+		close(get_fd);
+		if (rename(get_tmp, get_name) == -1) {
+			unlink(get_tmp);
+			err(EXIT_FAILURE, "rename %s", get_name);
+		}
+		if (verbose >= 0) {
+			elapsed = ts_elapsed(&span, &now);
+			printf("%s: %lld bytes in %f seconds, %.1f KB/s, "
+			    "SHA256 OK\n", get_name, get_size, elapsed,
+			    (elapsed > 0) ? get_size / elapsed / 1024 : 0);
+		}
+		free(get_path);
+		free(get_sums);
+		free(get_tmp);
+	}
+
+	/* -r: what the sweep found, the fastest first */
+	rank_time = time(NULL);
+	if (rank_fd != -1) {
+		rank_doc(&rank_buf[0], &rank_len[0], target[0], array,
+		    array_length, array[0], s, rank_time);
+	}
+
+	/*
+	 * -d: stays up and re-probes a few mirrors at a time, spread out
+	 * so that a fleet of hosts doesn't probe in step. The installed
+	 * mirror is only replaced by one which keeps beating it.
+	 */
+	if (interval > 0) {
+		installed = array[0];
+		if (f) {
+			fprintf(to_write, "installurl %zu\n%s\n",
+			    strlen(installed->ftp_file) + 1,
+			    installed->ftp_file);
+			fflush(to_write);
+		} else if (verbose >= 0) {
+			printf("As root, type:\necho \"%s\" > "
+			    "/etc/installurl\n", installed->ftp_file);
+		}
+		fflush(stdout);
+		trace_close(&trace);
+
+		streak = tail_next = 0;
+		rival = NULL;
+		for (;;) {
+			elapsed = interval *
+			    (0.9 + arc4random_uniform(1000) / 5000.0);
+			if (rank_fd != -1) {
+				/* -r: the installed mirror and the rest */
+				rank_doc(&rank_buf[0], &rank_len[0], target[0],
+				    array, array_length, installed, s,
+				    rank_time);
+				if (rank_serve(rank_fd, kq, elapsed, rank_buf,
+				    rank_len, target, targets) == -1)
+					err(EXIT_FAILURE, "ev_wait line: %d",
+					    __LINE__);
+			} else {
+				timeout.tv_sec = (time_t) elapsed;
+				timeout.tv_nsec = (long) ((elapsed -
+				    (double) timeout.tv_sec) * 1000000000.0);
+				/* a signal doesn't bring the re-probe forward */
+				while (nanosleep(&timeout, &timeout) == -1 &&
+				    errno == EINTR)
+					;
+			}
+
+			qsort(array, array_length, sizeof(struct mirror_st *),
+			    daemon_cmp);
+			n = 0;
+			for (c = 0; c < array_length && n < DAEMON_TOP; ++c)
+				cand[n++] = array[c];
+			for (c = 0; c < n && cand[c] != installed; ++c)
+				;
+			if (c == n)
+				cand[n++] = installed;
+			for (i = 0; i < DAEMON_TAIL &&
+			    array_length > DAEMON_TOP + i; ++i) {
+				m = array[DAEMON_TOP + tail_next++ %
+				    (array_length - DAEMON_TOP)];
+				if (m != installed)
+					cand[n++] = m;
+			}
+
+			dns = dns_prefetch(cand, n, &dns_len, kq, s);
+			if (dns == NULL)
+				err(EXIT_FAILURE, "dns_prefetch line: %d",
+				    __LINE__);
+			if (probe_batch(cand, n, kq, s, tls_cfg, tag, range,
+			    cap, dns, dns_len, 0) == -1)
+				err(EXIT_FAILURE, "probe_batch line: %d",
+				    __LINE__);
+			dns_free(dns, dns_len);
+
+			/* a timeout or an error counts against it */
+			rank_time = time(NULL);
+			for (c = 0; c < n; ++c) {
+				hist_update(cand[c]->hist, (cand[c]->diff < s) ?
+				    cand[c]->diff : -1, rank_time);
+			}
+			/* the next run starts from what was learnt since */
+			if (f)
+				hist_send(to_write, hist, hist_total,
+				    rank_time);
+
+			if (verbose >= 2) {
+				printf("\n");
+				for (c = 0; c < n; ++c) {
+					if (cand[c]->diff < s)
+						printf("%f", cand[c]->diff);
+					else if (cand[c]->diff == s)
+						printf("Timeout");
+					else
+						printf("Download Error");
+					printf(" : %s\n", cand[c]->ftp_file);
+				}
+			}
+
+			qsort(cand, n, sizeof(struct mirror_st *),
+			    daemon_cmp);
+			m = cand[0];
+			if (m != installed && m->hist->ok > 0 &&
+			    m->hist->fails == 0 && (installed->hist->fails >
+			    0 || m->hist->ewma * (1 + hyst) <
+			    installed->hist->ewma)) {
+				streak = (m == rival) ? streak + 1 : 1;
+				rival = m;
+			} else {
+				streak = 0;
+				rival = NULL;
+			}
+
+			if (verbose >= 1) {
+				printf("installed %f : %s\n",
+				    installed->hist->ewma,
+				    installed->ftp_file);
+				if (rival != NULL) {
+					printf("faster %d of %d : %s\n",
+					    streak, DAEMON_STREAK,
+					    rival->ftp_file);
+				}
+			}
+			fflush(stdout);
+			if (streak < DAEMON_STREAK)
+				continue;
+
+			installed = rival;
+			streak = 0;
+			rival = NULL;
+			if (f) {
+				fprintf(to_write, "installurl %zu\n%s\n",
+				    strlen(installed->ftp_file) + 1,
+				    installed->ftp_file);
+				fflush(to_write);
+			} else if (verbose >= 0) {
+				printf("As root, type:\necho \"%s\" > "
+				    "/etc/installurl\n", installed->ftp_file);
+				fflush(stdout);
+			}
+		}
+	}
+
+	/* -L: installurl points at the proxy, which stays up */
+	if (proxy_fd != -1) {
+		snprintf(proxy_url, sizeof(proxy_url), "http://127.0.0.1:%d",
+		    proxy_port);
+		if (f) {
+			fprintf(to_write, "installurl %zu\n%s\n",
+			    strlen(proxy_url) + 1, proxy_url);
+			fclose(to_write);
+			fflush(stdout);
+			waitpid(write_pid, &i, 0);
+		} else if (verbose >= 0) {
+			printf("As root, type:\necho \"%s\" > "
+			    "/etc/installurl\n", proxy_url);
+		}
+		fflush(stdout);
+		trace_close(&trace);
+
+		proxy_run(proxy_fd, array, array_length, kq, s, tls_cfg,
+		    verbose);
+		err(EXIT_FAILURE, "ev_wait line: %d", __LINE__);
+	}
+
+	/* -r without -d: installurl is set as usual and the ranking served */
+	if (rank_fd != -1) {
+		if (f) {
+			fprintf(to_write, "installurl %zu\n%s\n",
+			    strlen(array[0]->ftp_file) + 1, array[0]->ftp_file);
+			fclose(to_write);
+			fflush(stdout);
+			waitpid(write_pid, &i, 0);
+		} else if (verbose >= 0) {
+			printf("As root, type:\necho \"%s\" > "
+			    "/etc/installurl\n", array[0]->ftp_file);
 		}
+		fflush(stdout);
+		trace_close(&trace);
+
+		rank_serve(rank_fd, kq, -1, rank_buf, rank_len, target,
+		    targets);
+		err(EXIT_FAILURE, "ev_wait line: %d", __LINE__);
+	}
+
+	if (f) {
 		
 		/* sends the fastest mirror to write_pid process */
-		printf("%s\n", array[0]->ftp_file);
-		
-		/* needed for verbose == -1 */
+		clock_gettime(CLOCK_MONOTONIC, &span);
+		fprintf(to_write, "installurl %zu\n%s\n",
+		    strlen(array[0]->ftp_file) + 1, array[0]->ftp_file);
+		fclose(to_write);
+		free(array);
+		arena_free(&arena);
+
+		/* the child reports what it wrote */
 		fflush(stdout);
 
 		waitpid(write_pid, &i, 0);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		trace_span(&trace, "write", 0, &span, &now, NULL);
+		trace_close(&trace);
 
 		return i;
 	}
@@ -1036,6 +7182,9 @@ main(int argc, char *argv[])
 		printf("As root, type:\necho \"%s\" > /etc/installurl\n",
 		    array[0]->ftp_file);
 	}
+	free(array);
+	arena_free(&arena);
+	trace_close(&trace);
 
 	return EXIT_SUCCESS;
 }
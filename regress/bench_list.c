@@ -0,0 +1,43 @@
+/*
+ * Times how pkg_ping.c reads a -l list and builds the mirror table out
+ * of it, interning and deduplicating the URLs, eg. "bench_list file".
+ * genlist.sh writes such lists.
+ */
+
+#define main pkg_ping_main
+#include "../pkg_ping.c"
+#undef main
+
+int
+main(int argc, char *argv[])
+{
+	struct list_st l;
+	struct arena_st a;
+	struct mirror_st **array;
+	struct timespec start, listed, built;
+	int length;
+
+	if (argc != 2)
+		errx(EXIT_FAILURE, "usage: bench_list file");
+
+	memset(&l, 0, sizeof(l));
+	memset(&a, 0, sizeof(a));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (list_read(&l, argv[1], NULL, NULL) == -1)
+		errx(EXIT_FAILURE, "no mirrors read from %s", argv[1]);
+	clock_gettime(CLOCK_MONOTONIC, &listed);
+	array = mirror_table(&l, 0, 1, &a, &length);
+	if (array == NULL)
+		err(EXIT_FAILURE, "mirror_table");
+	clock_gettime(CLOCK_MONOTONIC, &built);
+
+	printf("%8d entries, %8d mirrors: read %f, build %f seconds\n",
+	    l.length, length, ts_elapsed(&start, &listed),
+	    ts_elapsed(&listed, &built));
+
+	free(array);
+	arena_free(&a);
+	list_free(&l);
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Times the ftp.html parser of pkg_ping.c on a page of n made up mirrors,
+ * fed to it in blocks the way the page arrives, eg. "bench_parse 100000".
+ * Lines which straddle two blocks are gathered, as from the network.
+ */
+
+#define main pkg_ping_main
+#include "../pkg_ping.c"
+#undef main
+
+/* what http_body() hands list_feed() at a time, about */
+#define BLOCK	16384
+
+int
+main(int argc, char *argv[])
+{
+	struct list_st l;
+	struct timespec start, end;
+	const char *errstr;
+	char *page = NULL;
+	size_t page_len = 0, off, n;
+	FILE *out;
+	double elapsed;
+	int c, count;
+
+	if (argc != 2)
+		errx(EXIT_FAILURE, "usage: bench_parse mirrors");
+	count = strtonum(argv[1], 1, 10000000, &errstr);
+	if (errstr != NULL)
+		errx(EXIT_FAILURE, "mirrors is %s: %s", errstr, argv[1]);
+
+	out = open_memstream(&page, &page_len);
+	if (out == NULL)
+		err(EXIT_FAILURE, "open_memstream");
+	fprintf(out, "<html>\n<h3 id=https>HTTPS</h3>\n<table>\n");
+	for (c = 0; c < count; ++c) {
+		fprintf(out, "<tr>\n\t<strong>Country %d</strong><br>\n", c);
+		fprintf(out, "\t<a href=\"%s://mirror%d.example.org/pub/"
+		    "OpenBSD/\">\n", (c % 3) ? "https" : "ftp", c);
+		fprintf(out, "\t%s://mirror%d.example.org/pub/OpenBSD/</a>\n",
+		    (c % 3) ? "https" : "ftp", c);
+		fprintf(out, "\t<td>%.*s\n", c % 200,
+		    "a note on the mirror which is rather long and goes on "
+		    "a note on the mirror which is rather long and goes on "
+		    "a note on the mirror which is rather long and goes on "
+		    "a note on the mirror which is rather long and goes on");
+	}
+	fprintf(out, "\trsync://mirror.example.org/OpenBSD/</a>\n</html>\n");
+	if (fclose(out) == EOF)
+		err(EXIT_FAILURE, "fclose");
+
+	memset(&l, 0, sizeof(l));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (off = 0; off < page_len; off += n) {
+		n = (page_len - off < BLOCK) ? page_len - off : BLOCK;
+		list_feed(&l, page + off, n);
+	}
+	list_end(&l);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (l.error || l.length != count)
+		errx(EXIT_FAILURE, "parsed %d of %d mirrors", l.length, count);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	printf("%8d mirrors, %10zu bytes: %f seconds, %.0f MB/s\n", count,
+	    page_len, elapsed, page_len / elapsed / 1000000);
+
+	free(page);
+	return 0;
+}
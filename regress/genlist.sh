@@ -0,0 +1,19 @@
+#!/bin/sh
+#
+# writes a -l list of n made up mirrors, eg. "sh genlist.sh 100000": a
+# third of them ftp, which is probed over http, and one line in ten a
+# mirror listed before, for the table to drop
+
+if [ $# -ne 1 ]; then
+	echo "usage: genlist.sh mirrors" >&2
+	exit 1
+fi
+
+awk -v n="$1" 'BEGIN {
+	srand(1)
+	for (i = 0; i < n; ++i) {
+		m = (i > 0 && i % 10 == 0) ? int(rand() * i) : i
+		printf "%s://mirror%d.example.org/pub/OpenBSD Mirror %d\n",
+		    (m % 3 == 0) ? "ftp" : "http", m, m
+	}
+}'
@@ -0,0 +1,414 @@
+/*
+ * A stand-in for a few OpenBSD mirrors on 127.0.0.1, to time pkg_ping
+ * against without the internet. Each argument is a mirror:
+ *
+ *	[https:]port:delay[:jitter[:rate[:fail]]]
+ *
+ * 'delay' is how many seconds it waits before it answers, give or take
+ * up to 'jitter' seconds each time, 'rate' caps the bytes per second it
+ * sends, 0 for as fast as it can, and 'fail' is how it goes wrong, if
+ * at all:
+ *
+ *	404	answers "404 Not Found"
+ *	hang	never answers
+ *	close	closes the connection without answering
+ *	stall	stops sending halfway through the file
+ *
+ * Every path is a file of -b bytes, 65536 by default, sent over a new
+ * connection for each request. "https:" mirrors take TLS with the -c
+ * certificate and -k key. With -w port, /ftp.html on that port lists
+ * the mirrors the way www.openbsd.org does, for "pkg_ping --list-url".
+ *
+ * Once it listens on every port, it goes into the background and prints
+ * its pid, which is also the process group of the children answering:
+ * "kill -- -pid" stops them all.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#ifndef __OpenBSD__
+#define pledge(promises, execpromises)	0
+#endif
+
+#define MIRROR_MAX	32
+
+#define FAIL_NONE	0
+#define FAIL_404	1
+#define FAIL_HANG	2
+#define FAIL_CLOSE	3
+#define FAIL_STALL	4
+
+struct mirror_st {
+	int port;
+	int8_t https;
+	double delay;
+	double jitter;
+	long long rate;
+	int fail;
+	int fd;
+};
+
+/* one connection, over TLS if tls isn't NULL */
+struct conn_st {
+	int fd;
+	struct tls *tls;
+};
+
+static void
+pause_for(double s)
+{
+	struct timespec ts;
+
+	if (s <= 0)
+		return;
+	ts.tv_sec = (time_t) s;
+	ts.tv_nsec = (long) ((s - (double) ts.tv_sec) * 1000000000.0);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static ssize_t
+conn_read(struct conn_st *c, char *buf, size_t len)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (c->tls != NULL)
+			n = tls_read(c->tls, buf, len);
+		else
+			n = read(c->fd, buf, len);
+		if ((c->tls != NULL && (n == TLS_WANT_POLLIN ||
+		    n == TLS_WANT_POLLOUT)) ||
+		    (c->tls == NULL && n == -1 && errno == EINTR))
+			continue;
+		return n;
+	}
+}
+
+static int
+send_all(struct conn_st *c, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if (c->tls != NULL) {
+			n = tls_write(c->tls, buf, len);
+			if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+				continue;
+		} else {
+			n = write(c->fd, buf, len);
+			if (n == -1 && errno == EINTR)
+				continue;
+		}
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* /ftp.html as www.openbsd.org lays it out, listing 'mirror' */
+static char *
+list_page(struct mirror_st *mirror, int count, size_t *len)
+{
+	FILE *fp;
+	char *page = NULL;
+	int n;
+
+	fp = open_memstream(&page, len);
+	if (fp == NULL)
+		err(EXIT_FAILURE, "open_memstream line: %d", __LINE__);
+	fprintf(fp, "<html>\n<h3 id=https>Mirrors</h3>\n<table>\n");
+	for (n = 0; n < count; ++n) {
+		fprintf(fp, "<tr>\n\t<strong>Mirror %d</strong><br>\n"
+		    "\t<a href=\"%s://127.0.0.1:%d/pub/OpenBSD/\">\n"
+		    "\t%s://127.0.0.1:%d/pub/OpenBSD/</a>\n",
+		    mirror[n].port, (mirror[n].https) ? "https" : "http",
+		    mirror[n].port, (mirror[n].https) ? "https" : "http",
+		    mirror[n].port);
+	}
+	fprintf(fp, "<tr>\n\t<strong>Rsync</strong><br>\n"
+	    "\trsync://127.0.0.1/OpenBSD/</a>\n</table>\n</html>\n");
+	if (fclose(fp) == EOF)
+		err(EXIT_FAILURE, "fclose line: %d", __LINE__);
+	return page;
+}
+
+/*
+ * in a child of its own: reads the request and answers it as m would,
+ * with 'page' instead of the file if it isn't NULL
+ */
+static void
+serve(struct mirror_st *m, struct conn_st *c, long long size,
+    const char *page, size_t page_len)
+{
+	char buf[16384], head[256];
+	long long sent = 0, chunk;
+	size_t got = 0;
+	ssize_t n;
+
+	/* the request ends with an empty line; what it asks for is moot */
+	while (got < sizeof(buf) - 1) {
+		n = conn_read(c, buf + got, sizeof(buf) - 1 - got);
+		if (n <= 0)
+			return;
+		got += n;
+		buf[got] = '\0';
+		if (strstr(buf, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	/* -w: the list of the mirrors, at once */
+	if (page != NULL) {
+		snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+		    "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		    page_len);
+		if (send_all(c, head, strlen(head)) == 0)
+			send_all(c, page, page_len);
+		return;
+	}
+
+	/* each answer takes its own delay, within the jitter */
+	srandom(getpid() ^ time(NULL));
+	pause_for(m->delay +
+	    m->jitter * ((random() % 2001) - 1000) / 1000.0);
+
+	switch (m->fail) {
+	case FAIL_HANG:
+		for (;;)
+			pause();
+	case FAIL_CLOSE:
+		return;
+	case FAIL_404:
+		snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\n"
+		    "Content-Length: 0\r\nConnection: close\r\n\r\n");
+		send_all(c, head, strlen(head));
+		return;
+	}
+
+	snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+	    "Content-Length: %lld\r\nConnection: close\r\n\r\n", size);
+	if (send_all(c, head, strlen(head)) == -1)
+		return;
+
+	memset(buf, 'x', sizeof(buf));
+	while (sent < size) {
+		if (m->fail == FAIL_STALL && sent >= size / 2) {
+			for (;;)
+				pause();
+		}
+
+		/* a tenth of a second's worth at a time, under a cap */
+		chunk = (m->rate > 0) ? m->rate / 10 : (long long)sizeof(buf);
+		if (chunk < 1)
+			chunk = 1;
+		if (chunk > (long long)sizeof(buf))
+			chunk = sizeof(buf);
+		if (chunk > size - sent)
+			chunk = size - sent;
+		if (send_all(c, buf, chunk) == -1)
+			return;
+		sent += chunk;
+		if (m->rate > 0)
+			pause_for((double) chunk / m->rate);
+	}
+}
+
+static int
+listen_port(int port)
+{
+	struct sockaddr_in sin;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		err(EXIT_FAILURE, "socket line: %d", __LINE__);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1)
+		err(EXIT_FAILURE, "bind %d", port);
+	if (listen(fd, 64) == -1)
+		err(EXIT_FAILURE, "listen line: %d", __LINE__);
+	return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct mirror_st mirror[MIRROR_MAX + 1];
+	struct pollfd pfd[MIRROR_MAX + 1];
+	struct tls_config *cfg;
+	struct tls *srv = NULL;
+	struct conn_st conn;
+	char *p, *fail, *page = NULL;
+	const char *cert = NULL, *key = NULL;
+	long long size = 65536;
+	size_t page_len = 0;
+	int c, n, fd, www = 0, https = 0, count;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "b:c:k:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			size = strtoll(optarg, &p, 10);
+			if (*optarg == '\0' || *p != '\0' || size < 1)
+				errx(EXIT_FAILURE, "-b is invalid: %s", optarg);
+			break;
+		case 'c':
+			cert = optarg;
+			break;
+		case 'k':
+			key = optarg;
+			break;
+		case 'w':
+			www = strtol(optarg, &p, 10);
+			if (*optarg == '\0' || *p != '\0' || www < 1 ||
+			    www > 65535)
+				errx(EXIT_FAILURE, "-w is invalid: %s", optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0 || argc > MIRROR_MAX)
+		goto usage;
+
+	for (n = 0; n < argc; ++n) {
+		struct mirror_st *m = &mirror[n];
+
+		memset(m, 0, sizeof(struct mirror_st));
+		p = argv[n];
+		if (!strncmp(p, "https:", 6)) {
+			m->https = https = 1;
+			p += 6;
+		}
+		m->port = strtol(p, &p, 10);
+		if (*p != ':' || m->port < 1 || m->port > 65535)
+			goto usage;
+		m->delay = strtod(p + 1, &p);
+		if (m->delay < 0)
+			goto usage;
+		if (*p == ':') {
+			m->jitter = strtod(p + 1, &p);
+			if (m->jitter < 0)
+				goto usage;
+		}
+		if (*p == ':') {
+			m->rate = strtoll(p + 1, &p, 10);
+			if (m->rate < 0)
+				goto usage;
+		}
+		if (*p == ':') {
+			fail = p + 1;
+			if (!strcmp(fail, "404"))
+				m->fail = FAIL_404;
+			else if (!strcmp(fail, "hang"))
+				m->fail = FAIL_HANG;
+			else if (!strcmp(fail, "close"))
+				m->fail = FAIL_CLOSE;
+			else if (!strcmp(fail, "stall"))
+				m->fail = FAIL_STALL;
+			else
+				goto usage;
+		} else if (*p != '\0')
+			goto usage;
+
+		m->fd = listen_port(m->port);
+		pfd[n].fd = m->fd;
+		pfd[n].events = POLLIN;
+	}
+	count = argc;
+
+	/* -w: one more listener, which only serves the list */
+	if (www > 0) {
+		page = list_page(mirror, count, &page_len);
+		memset(&mirror[count], 0, sizeof(struct mirror_st));
+		mirror[count].port = www;
+		mirror[count].fd = listen_port(www);
+		pfd[count].fd = mirror[count].fd;
+		pfd[count].events = POLLIN;
+		++count;
+	}
+
+	if (https) {
+		if (cert == NULL || key == NULL)
+			errx(EXIT_FAILURE, "https: mirrors need -c and -k");
+		if ((cfg = tls_config_new()) == NULL ||
+		    (srv = tls_server()) == NULL)
+			errx(EXIT_FAILURE, "tls_config_new line: %d", __LINE__);
+		if (tls_config_set_cert_file(cfg, cert) == -1 ||
+		    tls_config_set_key_file(cfg, key) == -1)
+			errx(EXIT_FAILURE, "%s", tls_config_error(cfg));
+		if (tls_configure(srv, cfg) == -1)
+			errx(EXIT_FAILURE, "%s", tls_error(srv));
+	}
+
+	/* the children are never waited for */
+	signal(SIGCHLD, SIG_IGN);
+
+	if (daemon(1, 1) == -1)
+		err(EXIT_FAILURE, "daemon line: %d", __LINE__);
+	printf("%ld\n", (long) getpid());
+	fflush(stdout);
+	close(STDOUT_FILENO);
+
+	if (pledge("stdio inet proc", NULL) == -1)
+		err(EXIT_FAILURE, "pledge line: %d", __LINE__);
+
+	for (;;) {
+		if (poll(pfd, count, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll line: %d", __LINE__);
+		}
+		for (n = 0; n < count; ++n) {
+			if (!(pfd[n].revents & POLLIN))
+				continue;
+			fd = accept(pfd[n].fd, NULL, NULL);
+			if (fd == -1)
+				continue;
+			pid = fork();
+			if (pid == 0) {
+				for (c = 0; c < count; ++c)
+					close(pfd[c].fd);
+				conn.fd = fd;
+				conn.tls = NULL;
+				if (mirror[n].https &&
+				    tls_accept_socket(srv, &conn.tls, fd) == -1)
+					_exit(1);
+				serve(&mirror[n], &conn, size,
+				    (www > 0 && n == count - 1) ? page : NULL,
+				    page_len);
+				if (conn.tls != NULL)
+					tls_close(conn.tls);
+				close(fd);
+				_exit(0);
+			}
+			close(fd);
+		}
+	}
+
+usage:
+	fprintf(stderr, "usage: mirrord [-b bytes] [-c cert -k key] "
+	    "[-w port]\n"
+	    "\t[https:]port:delay[:jitter[:rate[:404|hang|close|stall]]] ...\n");
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# sweeps stand-in mirrors on 127.0.0.1 with pkg_ping, which fetches and
+# parses their ftp.html as it would www.openbsd.org's, prints the wall
+# time of each sweep and checks that it picks the mirror which is really
+# the fastest, eg. "sh mirrors.sh ../pkg_ping -j 4": the arguments after
+# the first are passed on to pkg_ping. The http mirrors are swept, then
+# with -S and -C the https ones, if openssl(1) can make them a
+# certificate. PORT moves them, 18400 by default: ftp.html is served on
+# it and the mirrors on the ports above it. It is run from this
+# directory, as "make regress" does, beside mirrord and walltime.
+
+pkg_ping=${1:-../pkg_ping}
+[ $# -gt 0 ] && shift
+port=${PORT:-18400}
+dir=$(mktemp -d) || exit 1
+pid=
+
+trap 'kill -TERM -$pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+# a certificate for 127.0.0.1, which -C then trusts
+https=
+if openssl req -x509 -newkey rsa:2048 -nodes -days 1 \
+    -subj /CN=127.0.0.1 -addext subjectAltName=IP:127.0.0.1 \
+    -keyout "$dir/key.pem" -out "$dir/cert.pem" > /dev/null 2>&1; then
+	https="https:$((port + 8)):0.1:0.02 https:$((port + 9)):0.5:0.05"
+else
+	echo "mirrors.sh: no openssl(1) certificate, https isn't swept" >&2
+fi
+
+# the fastest first, then one slower in each way, then the failures
+pid=$(./mirrord -c "$dir/cert.pem" -k "$dir/key.pem" -w $port \
+    $((port + 1)):0.05:0.01 $((port + 2)):0.4:0.05 \
+    $((port + 3)):0:0:65536 $((port + 4)):0:0:0:404 \
+    $((port + 5)):0:0:0:hang $((port + 6)):0:0:0:close \
+    $((port + 7)):0:0:100000:stall $https) || exit 1
+
+# sweep(fastest, pkg_ping arguments): times one sweep and checks it
+sweep() {
+	fastest=$1
+	shift
+	echo "pkg_ping${*:+ $*}:"
+
+	# the release and architecture only make up the path, which is moot
+	out=$(./walltime "$pkg_ping" -f -s 2 -t snapshots/amd64 \
+	    --list-url "http://127.0.0.1:$port/ftp.html" "$@")
+
+	want="echo \"$fastest\" > /etc/installurl"
+	if ! printf '%s\n' "$out" | grep -qF "$want"; then
+		printf '%s\n' "$out" >&2
+		echo "mirrors.sh: pkg_ping${*:+ $*} didn't pick $fastest" >&2
+		exit 1
+	fi
+	echo "picked the fastest mirror, $fastest"
+}
+
+sweep "http://127.0.0.1:$((port + 1))/pub/OpenBSD" "$@"
+if [ -n "$https" ]; then
+	sweep "https://127.0.0.1:$((port + 8))/pub/OpenBSD" \
+	    -S -C "$dir/cert.pem" "$@"
+fi
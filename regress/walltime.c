@@ -0,0 +1,42 @@
+/*
+ * Runs a command and prints how long it took on the monotonic clock,
+ * to the millisecond, eg. "walltime ../pkg_ping -f": "real 1.234" goes
+ * to stderr once it exits, and its exit status is walltime's.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	pid_t pid;
+	int status;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: walltime command [argument ...]\n");
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork line: %d", __LINE__);
+	if (pid == 0) {
+		execvp(argv[1], argv + 1);
+		err(127, "%s", argv[1]);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		err(EXIT_FAILURE, "waitpid line: %d", __LINE__);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fprintf(stderr, "real %.3f\n", (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+	return (WIFEXITED(status)) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}